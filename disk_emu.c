@@ -81,9 +81,6 @@ int read_blocks(int start_address, int nblocks, void *buffer)
     int i, s;
     s = 0;
 
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
     if (start_address + nblocks > MAX_BLOCK)
     {
@@ -98,11 +95,10 @@ int read_blocks(int start_address, int nblocks, void *buffer)
     for (i = 0; i < nblocks; ++i)
     {
         s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-        memcpy((char *)buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
+        /*Reads straight into the buffer, no temporary buffer is needed*/
+        fread((char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE, 1, fp);
     }
 
-    free(blockRead);
     return s;
 }
 
@@ -114,8 +110,6 @@ int write_blocks(int start_address, int nblocks, void *buffer)
     int i, s;
     s = 0;
 
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
     if (start_address + nblocks > MAX_BLOCK)
     {
@@ -132,12 +126,10 @@ int write_blocks(int start_address, int nblocks, void *buffer)
         /*Pause until the latency duration is elapsed*/
         usleep(L);
 
-        memcpy(blockWrite, (char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
-
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
+        /*Writes straight from the buffer, no temporary buffer is needed*/
+        fwrite((char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE, 1, fp);
         fflush(fp);
         s++;
     }
-    free(blockWrite);
     return s;
 }
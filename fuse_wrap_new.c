@@ -20,7 +20,7 @@ static int fuse_getattr(const char *path, struct stat *stbuf)
     
     memset(stbuf, 0, sizeof(struct stat));
     
-    if (strcmp(path, "/") == 0) {
+    if (sfs_isdir(path) == 1) {
         stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 2;
     } else if((size = sfs_getfilesize(path)) != -1) {
@@ -36,17 +36,37 @@ static int fuse_getattr(const char *path, struct stat *stbuf)
 static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         off_t offset, struct fuse_file_info *fi)
 {
-    char file_name[MAXFILENAME];
+    SfsDirEntry entries[64];
+    struct stat st;
+    int cursor = 0;
+    int res;
+    int i;
     
-    if (strcmp(path, "/") != 0)
+    if (sfs_isdir(path) != 1)
         return -ENOENT;
     
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
     
-    while(sfs_getnextfilename(file_name)) {
-        filler(buf, &file_name[1], NULL, 0);
+    // List the directory in batches, resolving its path once per batch. libfuse 2 only hands the inode number and
+    // the type bits of each stat to the kernel, so getattr still runs for every entry (e.g. for ls -l).
+    while((res = sfs_readdirplus(path, &cursor, entries, 64)) > 0) {
+        for (i = 0; i < res; i++) {
+            memset(&st, 0, sizeof(struct stat));
+            st.st_ino = entries[i].inode + 1;
+            if (entries[i].isDir) {
+                st.st_mode = S_IFDIR | 0755;
+                st.st_nlink = 2;
+            } else {
+                st.st_mode = S_IFREG | 0666;
+                st.st_nlink = 1;
+                st.st_size = entries[i].size;
+            }
+            filler(buf, entries[i].name, &st, 0);
+        }
     }
+    if (res == -1)
+        return -ENOENT;
     
     return 0;
 }
@@ -54,7 +74,7 @@ static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int fuse_unlink(const char *path)
 {
     int res;
-    char filename[MAXFILENAME];
+    char filename[MAXPATHNAME];
     
     strcpy(filename, path);
     res = sfs_remove(filename);
@@ -67,7 +87,7 @@ static int fuse_unlink(const char *path)
 static int fuse_open(const char *path, struct fuse_file_info *fi)
 {
     int res;
-    char filename[MAXFILENAME];
+    char filename[MAXPATHNAME];
     
     strcpy(filename, path);
     
@@ -85,7 +105,7 @@ static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
     int fd;
     int res;
     
-    char filename[MAXFILENAME];
+    char filename[MAXPATHNAME];
     
     strcpy(filename, path);
     
@@ -93,14 +113,11 @@ static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
     if (fd == -1)
         return -errno;
     
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
-    
-    res = sfs_fread(fd, buf, size);
+    res = sfs_pread(fd, buf, size, offset);
+    sfs_fclose(fd);
     if (res == -1)
         return -errno;
     
-    sfs_fclose(fd);
     return res;
 }
 
@@ -110,7 +127,7 @@ static int fuse_write(const char *path, const char *buf, size_t size,
     int fd;
     int res;
     
-    char filename[MAXFILENAME];
+    char filename[MAXPATHNAME];
     
     strcpy(filename, path);
     
@@ -118,30 +135,132 @@ static int fuse_write(const char *path, const char *buf, size_t size,
     if (fd == -1) 
         return -errno;
     
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
-    
-    res = sfs_fwrite(fd, buf, size);
+    res = sfs_pwrite(fd, buf, size, offset);
+    sfs_fclose(fd);
     if (res == -1)
         return -errno;
     
-    sfs_fclose(fd);
     return res;
 }
 
 static int fuse_truncate(const char *path, off_t size)
 {
-    char filename[MAXFILENAME];
+    char filename[MAXPATHNAME];
     int fd;
+    int res;
     
     strcpy(filename, path);
     
-    fd = sfs_remove(filename);
+    // sfs_fopen() would create a missing file
+    if (sfs_getfilesize(filename) < 0)
+        return -ENOENT;
+    
+    fd = sfs_fopen(filename);
     if (fd == -1)
         return -errno;
     
-    fd = sfs_fopen(filename);
+    res = sfs_ftruncate(fd, size);
     sfs_fclose(fd);
+    if (res == -1)
+        return -errno;
+    
+    return 0;
+}
+
+static int fuse_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    return fuse_truncate(path, size);
+}
+
+// Returns 0 if the directory `path` is in exists, or the error to report if it doesn't
+static int parent_error(const char *path)
+{
+    char parent[MAXPATHNAME];
+    char *slash;
+    
+    strcpy(parent, path);
+    slash = strrchr(parent, '/');
+    if (slash == NULL || slash == parent)
+        return 0;
+    *slash = '\0';
+    
+    switch (sfs_isdir(parent)) {
+    case 1:
+        return 0;
+    case 0:
+        return -ENOTDIR;
+    default:
+        return -ENOENT;
+    }
+}
+
+static int fuse_mkdir(const char *path, mode_t mode)
+{
+    char filename[MAXPATHNAME];
+    int res;
+    
+    if ((res = parent_error(path)) != 0)
+        return res;
+    if (sfs_isdir(path) != -1)
+        return -EEXIST;
+    
+    strcpy(filename, path);
+    
+    // The parent exists and the name is free, so only space can be missing
+    if (sfs_mkdir(filename) == -1)
+        return -ENOSPC;
+    
+    return 0;
+}
+
+static int fuse_rmdir(const char *path)
+{
+    char filename[MAXPATHNAME];
+    
+    switch (sfs_isdir(path)) {
+    case -1:
+        return -ENOENT;
+    case 0:
+        return -ENOTDIR;
+    }
+    
+    strcpy(filename, path);
+    
+    if (sfs_rmdir(filename) == -1)
+        return -ENOTEMPTY;
+    
+    return 0;
+}
+
+static int fuse_rename(const char *from, const char *to)
+{
+    char oldname[MAXPATHNAME];
+    char newname[MAXPATHNAME];
+    
+    int fromType = sfs_isdir(from);
+    int toType;
+    size_t fromLength = strlen(from);
+    int res;
+    
+    if (fromType == -1)
+        return -ENOENT;
+    if ((res = parent_error(to)) != 0)
+        return res;
+    if (fromType == 1 && strncmp(to, from, fromLength) == 0 && to[fromLength] == '/')
+        return -EINVAL; // Moving a directory inside itself
+    toType = sfs_isdir(to);
+    if (fromType == 0 && toType == 1)
+        return -EISDIR;
+    if (fromType == 1 && toType == 0)
+        return -ENOTDIR;
+    
+    strcpy(oldname, from);
+    strcpy(newname, to);
+    
+    // Either the directory being replaced isn't empty, or there was no space for the new name
+    if (sfs_rename(oldname, newname) == -1)
+        return toType == 1 ? -ENOTEMPTY : -ENOSPC;
+    
     return 0;
 }
 
@@ -157,7 +276,7 @@ static int fuse_mknod(const char *path, mode_t mode, dev_t rdev)
 
 static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp)
 {
-    char filename[MAXFILENAME];
+    char filename[MAXPATHNAME];
     int fd;
     
     strcpy(filename, path);
@@ -171,8 +290,12 @@ static struct fuse_operations xmp_oper = {
     .getattr = fuse_getattr,
     .readdir = fuse_readdir,
     .mknod = fuse_mknod,
+    .mkdir = fuse_mkdir,
+    .rmdir = fuse_rmdir,
     .unlink = fuse_unlink,
+    .rename = fuse_rename,
     .truncate = fuse_truncate,
+    .ftruncate = fuse_ftruncate,
     .open = fuse_open, 
     .read = fuse_read, 
     .write = fuse_write, 
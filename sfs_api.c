@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <limits.h>
 #include "sfs_api.h"
 #include "disk_emu.h"
 
@@ -9,6 +10,12 @@
 // -- MACROS --
 #define BYTE_OFFSET(b) ((b) / 8)
 #define BIT_OFFSET(b)  ((b) % 8)
+#define INLINE_DATA(inode) ((Byte *) (inode)->extents) // Data of an inode flagged with `INODE_INLINE_DATA`
+#define DIR_RECORD_SIZE(nameLength) ((DIR_RECORD_HEADER + (nameLength) + 3) & ~3) // Size of a record, 4B aligned
+
+// Inode flags
+#define INODE_INLINE_DATA 0x01 // The file's data is stored in the inode itself, in place of its extents
+#define INODE_DIRECTORY 0x02 // The inode is a directory, its data blocks hold `DirRecord`s
 
 
 // -- CONSTANTS --
@@ -17,19 +24,78 @@
 #define M 112 // Number of inode table blocks - calculated by running 'python calc_disk_alloc.py <Q>'
 #define N 8192 // Number of data blocks - calculated by running 'python calc_disk_alloc.py <Q>'
 #define L 1 // Number of free bitmap blocks - calculated by running 'python calc_disk_alloc.py <Q>'
-#define DIR_SIZE 2048  // Max directory size (number of files) - calculated by running 'python calc_disk_alloc.py <Q>'
-#define MAX_FILE_SIZE (268 * B)
-#define FDT_SIZE 10
+#define ROOT_DIR_INODE -2 // Stands for the inode number of the root directory, whose inode is kept in the super block
+#define BASE_INODES (M * B / 56) // Number of inodes in the inode table region (56B per inode)
+#define INODE_CHUNK_BLOCKS 7 // Number of data blocks added to the inode table when it runs out of inodes
+#define INODES_PER_CHUNK (INODE_CHUNK_BLOCKS * B / 56) // 128 inodes - chunks hold a whole number of inodes
+#define MAX_INODES (B * 8) // Max number of inodes, as tracked by the single block of the inode bitmap
+#define INODE_EXTENTS 4 // Number of extents (or extent tree index entries) stored inline in an inode
+#define NODE_EXTENTS 85 // Number of extents (or index entries) stored in an extent tree node block - (B - 4) / 12
+#define MAX_EXTENT_DEPTH 3 // Max number of index levels in an extent tree (the extent equivalent of triple-indirect)
+#define NODE_CACHE_SIZE 8 // Number of extent tree node blocks cached by readExtentNode()
+#define PENDING_POOL_SIZE 16 // Nodes an extent tree update can change before it allocates them from the heap - a path
+                             // through the tree and the nodes split off it take at most 9
+#define INLINE_DATA_SIZE (INODE_EXTENTS * sizeof(Extent)) // Files up to this size are stored in the inode, in place of its extents
+#define SCRATCH_BLOCKS 4 // Blocks of scratch memory, for the partially read/written first and last blocks of a request
+                         // and the blocks that span several buffers of a vectored request
+#define SCRATCH_POINTER_ARRAYS 2 // Arrays of block pointers (one per data block) in the scratch memory
+#define SCRATCH_EXTENT_ARRAYS (2 + 2 * MAX_EXTENT_DEPTH) // Arrays of extents (one per data block, plus one) in the
+                                                      // scratch memory: the runs written, and for an extent tree update
+                                                      // the entries and runs of each index level and the leaf extents
+#define READ_AHEAD_MIN_BLOCKS 4 // Blocks prefetched by the first sequential read of a file
+#define READ_AHEAD_MAX_BLOCKS 32 // Max blocks prefetched by sequential reads (the window doubles with each one)
+#define WRITE_BUFFER_BLOCKS 4 // Size of the buffer that gathers small appends of a file descriptor, in blocks
+#define FDT_MIN_SIZE 16 // Initial number of slots in the FDT, doubled whenever all of them are in use
+#define FDT_MAX_SIZE 4096 // Max number of files open at once
+#define DIR_INDEX_MIN_CAPACITY 64 // Initial number of slots in a directory's hash index (always a power of 2)
+#define DIR_FILTER_HASHES 3 // Number of bits set per filename in a directory's negative lookup filter
+#define DIR_RECORD_HEADER 12 // Size of the fixed part of a directory record (`sizeof(DirRecord)`), before the name
+#define DIR_GAP_GRANULE 16 // Directory blocks are grouped by their largest free gap in steps of this many bytes
+#define DIR_GAP_BUCKETS (B / DIR_GAP_GRANULE + 1)
+#define DEFRAG_MIN_AVG_RUN 8 // Files whose blocks form runs shorter than this on average are relocated by sfs_defrag()
 char DISKNAME[] = "SFS_DISK";
 
 
 // -- STRUCTS/TYPES --
 typedef char Byte; // Alias for char to improve comprehensibility
 
+typedef struct Extent {
+    int logicalStart; // First block of the file covered by the extent
+    int physicalStart; // Absolute address of the block that `logicalStart` maps to (or of the child node, in an index)
+    int length; // Number of blocks covered by the extent
+} Extent;
+
+typedef struct ExtentHeader {
+    short entries; // Number of extents in use
+    Byte depth; // 0 = the extents map data blocks, otherwise they are index entries pointing to nodes of depth - 1
+    Byte flags; // Inode flags (`INODE_*`), unused in extent tree nodes
+} ExtentHeader;
+
+typedef struct ExtentNode {
+    ExtentHeader header;
+    Extent extents[NODE_EXTENTS];
+} ExtentNode;
+
+typedef struct NodeCacheEntry {
+    int block; // Absolute address of the cached node, 0 if the entry is empty
+    int lastUsed; // Value of `nodeCacheClock` when the entry was last used (the least recently used entry is evicted)
+    ExtentNode node;
+} NodeCacheEntry;
+
+typedef struct PendingNode {
+    int block; // Absolute address of the node
+    int allocated; // Whether `block` was allocated by the update, it is released again if the update fails
+    int released; // Whether the update emptied the node, `block` is then released once the update succeeds
+    int fromHeap; // Whether the node was allocated from the heap, once `pendingPool` was used up
+    ExtentNode node; // Contents written once the update succeeds (unless `released`)
+    struct PendingNode *next;
+} PendingNode; // An extent tree node changed by an update in progress (see updateExtentTree())
+
 typedef struct Inode {
     int size; // Size of the inode's data in bytes
-    int blockPointers[13]; // 0-11 = direct pointers, 12 = single-indirect pointer
-} Inode;
+    ExtentHeader header;
+    Extent extents[INODE_EXTENTS]; // Sorted by `logicalStart`, logical blocks not covered by any extent are unmapped
+} Inode; // Inline data (see `INLINE_DATA`) takes the place of `extents`, so inodes are always 56B
 
 typedef struct SuperBlock {
     int magic;
@@ -38,28 +104,111 @@ typedef struct SuperBlock {
     int inodeTableSize; // Size of the inode table, in blocks (M)
     int dataBlocksCount; // Number of data blocks (N)
     int fbmSize; // Size of the free bitmap, in blocks (L)
-    Inode rootDir; // The inode for the root directory
+    Inode rootDirInode; // The inode for the root directory
+    int inodeCount; // Number of inodes in the inode table, including the ones in data blocks added when it grows
+    int inodeBitmapBlock; // Absolute address of the inode bitmap (a data block)
+    Inode inodeTableExt; // The inode mapping the data blocks that the inode table has grown into
 } SuperBlock;
 
-typedef struct DirEntry {
-    Byte used;
-    char filename[MAXFILENAME + 1];
-    short inodeNum;
-} DirEntry;
+typedef struct DirRecord {
+    unsigned short recordLength; // Bytes from the start of the record to the next one - records never span blocks, and
+                                 // the free space left in a block is part of the record before it
+    unsigned char nameLength; // Length of the name, 0 if the record is unused
+    Byte pad;
+    int inodeNum;
+    unsigned int hash; // Hash of the name, so that comparisons with other names can be rejected early
+    char name[]; // Not NUL-terminated
+} DirRecord;
+
+typedef struct DirIndexSlot {
+    unsigned int hash; // Hash of the filename of the directory entry, so probing only compares names on a full match
+    int dirPos; // Offset of the entry's record in the directory, -1 if the slot is empty
+} DirIndexSlot;
+
+typedef struct DirIndex {
+    DirIndexSlot *slots; // Open addressing hash table (linear probing) from filename to directory position
+    int capacity; // Number of slots, a power of 2
+    int count; // Number of slots in use
+    Byte *filter; // Bloom filter of the filenames in the index, 8 bits per slot - a clear bit means "definitely absent"
+    int staleRemovals; // Number of filenames removed since the filter was last rebuilt (their bits may still be set)
+} DirIndex;
+
+typedef struct Directory {
+    int inodeNum; // Inode of the directory (`ROOT_DIR_INODE` for the root directory)
+    Byte *records; // The data blocks of the directory, holding its records (entries)
+    int blocks; // Number of data blocks of the directory
+    DirIndex index; // Hash index from filename to record offset
+    int *blockGap; // Largest free gap (in bytes) of each block, i.e. the longest record that still fits in it
+    int *gapNext; // Blocks are kept in doubly linked lists by `blockGap / DIR_GAP_GRANULE`, so that a block with room
+    int *gapPrev; // for a record can be found without scanning the directory
+    int gapHead[DIR_GAP_BUCKETS]; // First block of each list (-1 if empty)
+    Extent *blockMap; // Decoded extents of the directory's inode (NULL until needed)
+    int blockMapEntries;
+} Directory;
+
+typedef struct OpenFile {
+    int inodeNum;
+    int refCount; // Number of file descriptors sharing the open file, it is released when the last one is closed
+    Extent *blockMap; // All the extents of the file, decoded from its extent tree on first use (NULL until then)
+    int blockMapEntries;
+    int blockMapCapacity; // Number of extents `blockMap` has room for
+    Byte *readAhead; // Blocks prefetched by sequential reads, room for `READ_AHEAD_MAX_BLOCKS` (NULL until needed)
+    int readAheadStart; // First logical block in `readAhead`
+    int readAheadBlocks; // Number of blocks in `readAhead`, 0 if it holds nothing
+    int bufferedFd; // Descriptor whose write buffer holds appends to the file (-1 if none), only one at a time
+    int unlinked; // The file was removed (or replaced by a rename) while open, it is released by the last sfs_fclose()
+} OpenFile; // State of an open inode, shared by all the descriptors it is open in
 
 typedef struct File {
-    short inodeNum;
-    int rwHeadPos;
+    short inodeNum; // -1 if the slot is free
+    int rwHeadPos; // Each descriptor has its own read/write head, even if the file is open in several of them
+    int lastReadEnd; // Offset where the last sfs_fread() ended (-1 if there was none)
+    int sequentialReads; // Number of sfs_fread() calls in a row that each started where the previous one ended
+    Byte *writeBuffer; // Appends gathered by sfs_fwrite(), room for `WRITE_BUFFER_BLOCKS` (NULL until needed, then kept
+                       // with the FDT slot)
+    int writeBufferStart; // Offset in the file of the first byte in `writeBuffer`
+    int writeBufferLength; // Number of bytes in `writeBuffer`, 0 if nothing is buffered
+    int writeBuffering; // Whether sfs_fwrite() gathers small appends in `writeBuffer` (see sfs_fsetbuffering())
+    OpenFile *openFile; // NULL if the slot is free
+    int nextFree; // Next slot in the FDT free list (-1 for the last one), only meaningful while the slot is free
 } File;
 
+typedef struct Mapping {
+    Byte *data; // Copy of the mapped range, handed out by sfs_mmap()
+    int fd; // Descriptor the range was mapped through, the mapping is released when it is closed
+    int offset; // Offset in the file of the first byte in `data`
+    int length;
+    int flags; // `SFS_MAP_SHARED` or `SFS_MAP_PRIVATE`
+    struct Mapping *next;
+} Mapping; // A range of a file mapped into memory by sfs_mmap()
+
 
 // -- STATIC MEMBERS --
 SuperBlock superBlock;
-Inode inodeTable[DIR_SIZE];
-DirEntry rootDirEntries[DIR_SIZE];
+Inode *inodeTable; // Inode table - the first `BASE_INODES` inodes live in the inode table region, the rest in data blocks
+Directory rootDir; // The root directory, loaded on mount
+Directory *dirCache[MAX_INODES]; // Subdirectories loaded so far, by inode number (NULL if not loaded)
+char cachedParentPath[MAXPATHNAME]; // Parent directory path of the last path resolved, e.g. "/a/b" for "/a/b/c"
+Directory *cachedParent; // Directory that `cachedParentPath` resolved to (NULL if the cache is empty)
 int currentFileIndex; // Used in sfs_getnextfilename() to track the index of the current file
 Byte fbm[L * B]; // Free bitmap
-File FDT[FDT_SIZE]; // File descriptor table
+Byte ibm[B]; // Inode bitmap
+int nextFreeInodeHint; // No inode below this one is free, so sfs_allocateInode() starts its search there
+Extent *inodeTableExtMap; // Decoded extents of `superBlock.inodeTableExt`
+int inodeTableExtMapEntries;
+File *FDT; // File descriptor table, grown on demand
+int fdtSize; // Number of slots in the FDT
+int fdtFreeHead; // First free slot of the FDT (-1 if all slots are in use), free slots are chained by `nextFree`
+OpenFile *openFiles[MAX_INODES]; // Open file of each inode (NULL if the inode isn't open)
+Mapping *mappings; // Ranges mapped by sfs_mmap() that are not unmapped yet
+int defragCursor; // Used in sfs_defrag() to track the inode to resume the defragmentation pass from
+Byte *scratch; // Scratch memory for reads and writes, allocated on mount and sized from the geometry
+int scratchSize;
+int scratchUsed; // Bytes of `scratch` handed out by scratchAlloc()
+NodeCacheEntry nodeCache[NODE_CACHE_SIZE]; // Extent tree nodes walked recently, so sequential I/O doesn't re-read them
+int nodeCacheClock;
+PendingNode pendingPool[PENDING_POOL_SIZE]; // Nodes changed by the extent tree update in progress
+int pendingPoolUsed; // Nodes of `pendingPool` handed out by addPendingNode()
 
 
 // -- HELPER FUNCTIONS --
@@ -84,7 +233,7 @@ int getBit(const Byte *bytes, int n) {
 int sfs_countFreeDataBlocks(void) {
     int count = 0;
     for (int i = 0; i < N; ++i) {
-        if (getBit(&fbm[BYTE_OFFSET(i)], i) == 0)
+        if (getBit(fbm, i) == 0)
             ++count;
     }
     return count;
@@ -101,10 +250,28 @@ int sfs_allocateFreeDataBlock(void) {
     return -1;
 }
 
+// Allocates the first run of `count` consecutive free data blocks, returning the absolute address of the first block
+int sfs_allocateContiguousDataBlocks(int count) {
+    int runStart = 0;
+    for (int i = 0; i < N; ++i) {
+        if (getBit(fbm, i) != 0) { // Run broken, the next run can start after this block at the earliest
+            runStart = i + 1;
+            continue;
+        }
+        if (i - runStart + 1 == count) {
+            for (int j = runStart; j <= i; ++j) {
+                setBit(fbm, j);
+            }
+            return runStart + 1 + superBlock.inodeTableSize; // Offset from absolute address of the data block
+        }
+    }
+    return -1;
+}
+
 // Deallocates a block by clearing its 'tracker bit' in the free bitmap
 int sfs_freeDataBlock(int block) {
     int n = block - 1 - superBlock.inodeTableSize; // Offset from absolute address of the data block
-    if (n < 0 || n > N) {
+    if (n < 0 || n >= N) {
         fprintf(stderr, "Failed to free block: block address is outside of free bitmap bounds.\n");
         return -1;
     }
@@ -113,472 +280,2306 @@ int sfs_freeDataBlock(int block) {
     return 0;
 }
 
-// Finds the first FDT slot not in use 
-int sfs_getNextFreeFDTPos(int startPos) {
-    for (int i = 0; i < FDT_SIZE; ++i) {
-        if (FDT[(startPos + i) % FDT_SIZE].inodeNum < 0)
-            return (startPos + i) % FDT_SIZE;
+// Hashes a filename (FNV-1a)
+unsigned int hashFilename(const char *filename) {
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *) filename; *c != '\0'; ++c) {
+        hash = (hash ^ *c) * 16777619u;
     }
-    return -1; // FDT is full
+    return hash;
 }
 
-// Finds up the first directory entry not in use
-int sfs_getNextFreeDirEntry(int startPos) {
-    for (int i = 0; i < DIR_SIZE; ++i) {
-        if (rootDirEntries[(startPos + i) % DIR_SIZE].used == 0) {
-            return (startPos + i) % DIR_SIZE;
-        }
+// Sets (if `set`) or tests the bits of a filename hash in the filter of a directory index, the bits are picked by
+// double hashing. Returns whether all the bits are set.
+int dirFilterBits(const DirIndex *index, unsigned int hash, int set) {
+    unsigned int mask = index->capacity * 8 - 1;
+    unsigned int step = ((hash >> 17) | (hash << 15)) | 1;
+    for (int i = 0; i < DIR_FILTER_HASHES; ++i) {
+        unsigned int bit = (hash + i * step) & mask;
+        if (set)
+            setBit(index->filter, bit);
+        else if (!getBit(index->filter, bit))
+            return 0;
     }
-    return -1; // Root directory is full
+    return 1;
 }
 
-// Gets the data block pointers (excluding the indirect pointer block) of an inode (up to `blocksToGet`)
-int getInodeBlockPointers(Inode inode, int pointers[], int blocksToGet) {
-    int i = 0;
-    for (; i < 12 && i < blocksToGet; ++i) {
-        pointers[i] = inode.blockPointers[i];
+// Rebuilds the filter of a directory index from the slots in use, clearing the bits of removed filenames
+void dirFilterRebuild(DirIndex *index) {
+    memset(index->filter, 0, index->capacity);
+    for (int i = 0; i < index->capacity; ++i) {
+        if (index->slots[i].dirPos >= 0)
+            dirFilterBits(index, index->slots[i].hash, 1);
     }
-    if (blocksToGet > 12) {
-        int indirectBlockPointers[B / sizeof(int)];
-        read_blocks(inode.blockPointers[12], 1, indirectBlockPointers);
+    index->staleRemovals = 0;
+}
 
-        for (; i < blocksToGet; ++i) {
-            pointers[i] = indirectBlockPointers[i - 12];
-        }
+// Resizes the slots of a directory index to `capacity` (a power of 2), re-inserting the slots in use
+int dirIndexResize(DirIndex *index, int capacity) {
+    DirIndexSlot *slots = (DirIndexSlot *) malloc(capacity * sizeof(DirIndexSlot));
+    Byte *filter = (Byte *) malloc(capacity);
+    if (slots == NULL || filter == NULL) {
+        fprintf(stderr, "Failed to resize directory index: ran out of memory.\n");
+        free(slots);
+        free(filter);
+        return -1;
+    }
+    for (int i = 0; i < capacity; ++i) {
+        slots[i].dirPos = -1;
     }
-    return i;
-}
 
+    for (int i = 0; i < index->capacity; ++i) {
+        if (index->slots[i].dirPos < 0)
+            continue;
+        int j = index->slots[i].hash & (capacity - 1);
+        while (slots[j].dirPos >= 0)
+            j = (j + 1) & (capacity - 1);
+        slots[j] = index->slots[i];
+    }
 
-// -- SFS API FUNCTIONS --
+    free(index->slots);
+    free(index->filter);
+    index->slots = slots;
+    index->filter = filter;
+    index->capacity = capacity;
+    dirFilterRebuild(index);
+    return 0;
+}
 
-void mksfs(int fresh) {
-    if (fresh) { // New file system
-        init_fresh_disk(DISKNAME, B, Q);
+// Adds the directory record at `dirPos`, whose name hashes to `hash`, to a directory index, growing the index to keep
+// it at most 3/4 full
+int dirIndexInsert(DirIndex *index, unsigned int hash, int dirPos) {
+    if ((index->count + 1) * 4 > index->capacity * 3
+        && dirIndexResize(index, index->capacity > 0 ? index->capacity * 2 : DIR_INDEX_MIN_CAPACITY) != 0)
+        return -1;
 
-        // Init super block
-        superBlock.blockSize = B;
-        superBlock.sfsSize = Q;
-        superBlock.inodeTableSize = M;
-        superBlock.dataBlocksCount = N;
-        superBlock.fbmSize = L;
-        superBlock.rootDir.size = DIR_SIZE * sizeof(DirEntry);
+    int i = hash & (index->capacity - 1);
+    while (index->slots[i].dirPos >= 0)
+        i = (i + 1) & (index->capacity - 1);
+    index->slots[i].hash = hash;
+    index->slots[i].dirPos = dirPos;
+    ++index->count;
+    dirFilterBits(index, hash, 1);
+    return 0;
+}
 
-        // Init inode table and root directory
-        for (short i = 0; i < DIR_SIZE; ++i) {
-            inodeTable[i].size = -1;
-            rootDirEntries[i].inodeNum = i;
-        }
+// Returns the slot of the index holding the record in `records` named `filename`, or -1 if there is none
+int dirIndexFindSlot(const DirIndex *index, const Byte *records, const char *filename) {
+    if (index->count == 0)
+        return -1;
 
-        // Write inodeTable to disk
-        write_blocks(1, superBlock.inodeTableSize, inodeTable);
+    // Most lookups of names that don't exist stop at the filter, without probing
+    unsigned int hash = hashFilename(filename);
+    if (!dirFilterBits(index, hash, 0))
+        return -1;
 
-        // Allocate blocks for root dir and then write the root dir to disk
-        int dirSizeInBlocks = ceil((double)superBlock.rootDir.size / B);
-        if (dirSizeInBlocks > 12) // Add a block for the indirect pointers
-            ++dirSizeInBlocks;
-        
-        if (N <= dirSizeInBlocks) {
-            fprintf(stderr, "Failed to make new sfs: sfs size is too small for the size of the root directory.\n");
-            return;
-        }
+    int length = strlen(filename);
+    for (int i = hash & (index->capacity - 1); index->slots[i].dirPos >= 0; i = (i + 1) & (index->capacity - 1)) {
+        if (index->slots[i].hash != hash)
+            continue;
+        const DirRecord *record = (const DirRecord *) (records + index->slots[i].dirPos);
+        if (record->nameLength == length && memcmp(record->name, filename, length) == 0)
+            return i;
+    }
+    return -1;
+}
 
-        int dirBlockPointers[dirSizeInBlocks];
-        for (int i = 0; i < dirSizeInBlocks; ++i) {
-            dirBlockPointers[i] = sfs_allocateFreeDataBlock();
-        }
+// Returns the offset of the record in `records` named `filename`, or -1 if there is none
+int dirIndexLookup(const DirIndex *index, const Byte *records, const char *filename) {
+    int slot = dirIndexFindSlot(index, records, filename);
+    return slot < 0 ? -1 : index->slots[slot].dirPos;
+}
 
-        int i = 0;
-        for (; i < 12 && i < dirSizeInBlocks; ++i) {
-            superBlock.rootDir.blockPointers[i] = dirBlockPointers[i];
-        }
-        if (dirSizeInBlocks > 12) {
-            int indirectBlockPointers[B / sizeof(int)];
-            for (; i < dirSizeInBlocks; ++i) {
-                indirectBlockPointers[i - 12] = sfs_allocateFreeDataBlock();
-            }
-            // Write the indirect pointers block first
-            write_blocks(dirBlockPointers[dirSizeInBlocks - 1], 1, indirectBlockPointers);
-            superBlock.rootDir.blockPointers[12] = dirBlockPointers[dirSizeInBlocks - 1];
+// Removes the record in `records` named `filename` from a directory index, shifting back the slots probed past it so
+// that lookups never need tombstones
+void dirIndexRemove(DirIndex *index, const Byte *records, const char *filename) {
+    int i = dirIndexFindSlot(index, records, filename);
+    if (i < 0)
+        return;
+
+    int mask = index->capacity - 1;
+    for (int j = (i + 1) & mask; index->slots[j].dirPos >= 0; j = (j + 1) & mask) {
+        // The slot at `j` can move to `i` unless its home slot lies cyclically in (i, j]
+        int home = index->slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            index->slots[i] = index->slots[j];
+            i = j;
         }
-        // Write directory entries to disk (we assume that the data blocks allocated are contiguous and in order)
-        write_blocks(dirBlockPointers[0], dirSizeInBlocks - 1, rootDirEntries);
-        
-        // Write the super block to disk too
-        write_blocks(0, 1, &superBlock);
-    } else { // Existing file system
-        init_disk(DISKNAME, B, Q);
-
-        // Load super block
-        read_blocks(0, 1, &superBlock);
+    }
+    index->slots[i].dirPos = -1;
+    --index->count;
 
-        // Load inode table
-        read_blocks(1, superBlock.inodeTableSize, inodeTable);
+    // The filter can't clear the bits of a single name, so rebuild it once there are more stale names than live ones
+    if (++index->staleRemovals > index->count)
+        dirFilterRebuild(index);
+}
 
-        // Load root directory
-        // Load directory entries from data blocks pointed to by the root dir inode
-        int dirSizeInBlocks = ceil((double)superBlock.rootDir.size / B);
-        int dirBlockPointers[dirSizeInBlocks * sizeof(int)];
-        getInodeBlockPointers(superBlock.rootDir, dirBlockPointers, dirSizeInBlocks);
-        
-        Byte dirBlocksData[dirSizeInBlocks * B];
-        for (int i = 0; i < dirSizeInBlocks; ++i) {
-            // Read root directory data block i
-            read_blocks(dirBlockPointers[i], 1, dirBlocksData + (i * B));
-        }   
-        
-        for (int i = 0; i < DIR_SIZE; ++i) {
-            rootDirEntries[i] = ((DirEntry *) dirBlocksData)[i];
-        }
-        
-        // Load free bitmap
-        read_blocks(superBlock.sfsSize - superBlock.fbmSize - 1, superBlock.fbmSize, fbm);
+// Rebuilds a directory index from the `size` bytes of records of a directory
+int dirIndexBuild(DirIndex *index, const Byte *records, int size) {
+    free(index->slots);
+    free(index->filter);
+    memset(index, 0, sizeof(DirIndex));
+    for (int offset = 0; offset < size; offset += ((const DirRecord *) (records + offset))->recordLength) {
+        const DirRecord *record = (const DirRecord *) (records + offset);
+        if (record->nameLength != 0 && dirIndexInsert(index, record->hash, offset) != 0)
+            return -1;
     }
+    return 0;
+}
+
+// Doubles the number of slots of the FDT (up to `FDT_MAX_SIZE`), adding the new slots to the free list
+int growFDT() {
+    int newSize = fdtSize == 0 ? FDT_MIN_SIZE : fdtSize * 2;
+    if (newSize > FDT_MAX_SIZE)
+        return -1;
+    File *newFDT = realloc(FDT, newSize * sizeof(File));
+    if (newFDT == NULL)
+        return -1;
+    FDT = newFDT;
 
-    // Init FDT
-    for (int i = 0; i < FDT_SIZE; ++i) {
+    // Chain the new slots in reverse, so the lowest one is handed out first
+    for (int i = newSize - 1; i >= fdtSize; --i) {
         FDT[i].inodeNum = -1;
+        FDT[i].openFile = NULL;
+        FDT[i].writeBuffer = NULL;
+        FDT[i].writeBufferLength = 0;
+        FDT[i].nextFree = fdtFreeHead;
+        fdtFreeHead = i;
     }
-    
-    // Init `currentFileIndex`
-    currentFileIndex = 0;
+    fdtSize = newSize;
+    return 0;
 }
 
-int sfs_getnextfilename(char *filename) {
-    // Look up the next used directory entry (= next file)
-    for (int i = currentFileIndex; i < DIR_SIZE; ++i) {
-        if (rootDirEntries[i].used == 1) {
-            if (strncpy(filename, rootDirEntries[i].filename, MAXFILENAME) == NULL) {
-                fprintf(stderr, "Failed to get filename: strcpy failed.\n");
-                return -1;
-            }
-            currentFileIndex = i;
-            break;
-        }
+// Allocates the scratch memory, sized so that every request fits: a few blocks, and arrays of as many block pointers
+// (and extents) as there are data blocks, each with room for its alignment
+int initScratch() {
+    free(scratch);
+    scratchSize = SCRATCH_BLOCKS * B + SCRATCH_POINTER_ARRAYS * (superBlock.dataBlocksCount * sizeof(int) + 8)
+                  + SCRATCH_EXTENT_ARRAYS * ((superBlock.dataBlocksCount + 1) * sizeof(Extent) + 8);
+    scratchUsed = 0;
+    scratch = (Byte *) malloc(scratchSize);
+    return scratch == NULL ? -1 : 0;
+}
+
+// Hands out `size` bytes of scratch memory (NULL if there isn't enough left). Scratch memory is released all at once, by
+// resetting `scratchUsed` to its value from before the allocations.
+void *scratchAlloc(int size) {
+    if (scratch == NULL || size <= 0 || size > scratchSize - scratchUsed)
+        return NULL;
+    size = (size + 7) & ~7; // Keep allocations aligned
+    if (size > scratchSize - scratchUsed)
+        return NULL;
+    void *p = scratch + scratchUsed;
+    scratchUsed += size;
+    return p;
+}
+
+// Gets the FDT slot that the next file opened goes in (the head of the free list), growing the FDT if it is full
+int sfs_getNextFreeFDTPos() {
+    if (fdtFreeHead < 0 && growFDT() != 0)
+        return -1; // FDT is full
+    return fdtFreeHead;
+}
+
+// Returns the record at `offset` in a directory
+DirRecord *dirRecord(const Directory *dir, int offset) {
+    return (DirRecord *) (dir->records + offset);
+}
+
+// Returns the free space at the end of a record (all of it if the record is unused)
+int dirRecordGap(const DirRecord *record) {
+    return record->nameLength == 0 ? record->recordLength : record->recordLength - DIR_RECORD_SIZE(record->nameLength);
+}
+
+// Recomputes the largest free gap of directory block `block`, and moves the block to the matching gap list
+void updateDirBlockGap(Directory *dir, int block) {
+    int gap = 0;
+    for (int offset = block * B; offset < (block + 1) * B; offset += dirRecord(dir, offset)->recordLength) {
+        if (dirRecordGap(dirRecord(dir, offset)) > gap)
+            gap = dirRecordGap(dirRecord(dir, offset));
     }
-    if (currentFileIndex == DIR_SIZE) // Reset to start of directory
-        currentFileIndex = 0;
 
-    return currentFileIndex;
+    // Unlink the block from its current list (a block that is being added has `blockGap` -1 and isn't in any list)
+    if (dir->blockGap[block] >= 0) {
+        if (dir->gapPrev[block] >= 0)
+            dir->gapNext[dir->gapPrev[block]] = dir->gapNext[block];
+        else
+            dir->gapHead[dir->blockGap[block] / DIR_GAP_GRANULE] = dir->gapNext[block];
+        if (dir->gapNext[block] >= 0)
+            dir->gapPrev[dir->gapNext[block]] = dir->gapPrev[block];
+    }
+
+    int bucket = gap / DIR_GAP_GRANULE;
+    dir->blockGap[block] = gap;
+    dir->gapPrev[block] = -1;
+    dir->gapNext[block] = dir->gapHead[bucket];
+    if (dir->gapHead[bucket] >= 0)
+        dir->gapPrev[dir->gapHead[bucket]] = block;
+    dir->gapHead[bucket] = block;
 }
 
-int sfs_getfilesize(const char *filename) {
-    if (strlen(filename) > MAXFILENAME) {
-        fprintf(stderr, "Failed to get file size: File name is too long.\n");
+// Resizes the gap lists of a directory to its number of blocks, and adds the blocks from `firstBlock` on to them
+int trackDirBlocks(Directory *dir, int firstBlock) {
+    int size = (dir->blocks > 0 ? dir->blocks : 1) * sizeof(int);
+    int *blockGap = (int *) realloc(dir->blockGap, size);
+    if (blockGap != NULL)
+        dir->blockGap = blockGap;
+    int *gapNext = (int *) realloc(dir->gapNext, size);
+    if (gapNext != NULL)
+        dir->gapNext = gapNext;
+    int *gapPrev = (int *) realloc(dir->gapPrev, size);
+    if (gapPrev != NULL)
+        dir->gapPrev = gapPrev;
+    if (blockGap == NULL || gapNext == NULL || gapPrev == NULL) {
+        fprintf(stderr, "Failed to track free directory space: ran out of memory.\n");
         return -1;
     }
 
-    // Look up the file in the directory
-    int dir_pos = -1;
-    for (int i = 0; i < DIR_SIZE; ++i) {
-        if (rootDirEntries[i].used != 0 && strcmp(rootDirEntries[i].filename, filename) == 0) {
-            dir_pos = i;
-            break;
+    if (firstBlock == 0) {
+        for (int i = 0; i < DIR_GAP_BUCKETS; ++i) {
+            dir->gapHead[i] = -1;
         }
     }
-    
-    if (dir_pos < 0) {
-        fprintf(stderr, "Failed to get file size: '%s' does not exist.\n", filename);
-        return -1;
-    } 
-    
-    // File exists, return file size
-    return inodeTable[rootDirEntries[dir_pos].inodeNum].size;
+    for (int i = dir->blocks - 1; i >= firstBlock; --i) { // The lowest block ends up first in its list
+        dir->blockGap[i] = -1;
+        updateDirBlockGap(dir, i);
+    }
+    return 0;
 }
 
-int sfs_fopen(char *filename) {
-    if (strlen(filename) > MAXFILENAME) {
-        fprintf(stderr, "Failed to open file: File name is too long.\n");
-        return -1;
+// Finds a directory block with a free gap of at least `size` bytes, or returns -1 if there is none. Only lists whose
+// blocks are all large enough are checked, so this takes the same time however many blocks the directory has.
+int findDirBlock(const Directory *dir, int size) {
+    for (int bucket = (size + DIR_GAP_GRANULE - 1) / DIR_GAP_GRANULE; bucket < DIR_GAP_BUCKETS; ++bucket) {
+        if (dir->gapHead[bucket] >= 0)
+            return dir->gapHead[bucket];
     }
+    return -1;
+}
 
-    // Look up the file in the directory
-    int dir_pos = -1;
-    for (int i = 0; i < DIR_SIZE; ++i) {
-        if (rootDirEntries[i].used != 0 && strcmp(rootDirEntries[i].filename, filename) == 0) {
-            dir_pos = i;
-            break;
-        }
+// Returns the offset of the first record of a directory at or after `offset` (offsets of removed records may now be
+// in the middle of the record before them)
+int nextDirRecord(const Directory *dir, int offset) {
+    if (offset <= 0 || offset >= dir->blocks * B)
+        return offset;
+    int record = (offset / B) * B;
+    while (record < offset)
+        record += dirRecord(dir, record)->recordLength;
+    return record;
+}
+
+// Sets the absolute addresses in `pointers` of the `count` blocks from `firstBlock` that are mapped by `extents`
+void mapExtents(const Extent extents[], int entries, int pointers[], int firstBlock, int count) {
+    // Binary search for the first extent that ends after `firstBlock` (the extents are sorted and don't overlap)
+    int lo = 0;
+    int hi = entries;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (extents[mid].logicalStart + extents[mid].length <= firstBlock)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
 
-    // Get next free FDT slot index - if the file is not in the FDT, we know in advance if and where there is space
-    int fdt_pos = sfs_getNextFreeFDTPos(0);
+    for (int i = lo; i < entries && extents[i].logicalStart < firstBlock + count; ++i) {
+        int start = extents[i].logicalStart > firstBlock ? extents[i].logicalStart : firstBlock;
+        int end = extents[i].logicalStart + extents[i].length;
+        if (end > firstBlock + count)
+            end = firstBlock + count;
 
-    if (dir_pos < 0) { // File does not exist, need to 'create' a new directory entry
-        if ((dir_pos = sfs_getNextFreeDirEntry(0)) < 0 ) { // Directory is full
-            fprintf(stderr, "Failed to create file: The directory is full.\n");
-            return -1;
+        for (int j = start; j < end; ++j) {
+            pointers[j - firstBlock] = extents[i].physicalStart + (j - extents[i].logicalStart);
         }
+    }
+}
 
-        if (fdt_pos < 0) { // FDT is full
-            fprintf(stderr, "Failed to create file: The FDT is full.\n");
-            return -1;
+// Returns the number of extents in the inode itself (none if it holds inline data instead)
+int inodeExtentEntries(const Inode *inode) {
+    return inode->header.flags & INODE_INLINE_DATA ? 0 : inode->header.entries;
+}
+
+// Reads an extent tree node, going through the node cache
+void readExtentNode(int block, ExtentNode *node) {
+    NodeCacheEntry *victim = &nodeCache[0];
+    for (int i = 0; i < NODE_CACHE_SIZE; ++i) {
+        if (nodeCache[i].block == block) {
+            nodeCache[i].lastUsed = ++nodeCacheClock;
+            memcpy(node, &nodeCache[i].node, B);
+            return;
         }
+        if (nodeCache[i].lastUsed < victim->lastUsed)
+            victim = &nodeCache[i];
+    }
 
-        // Update entry at the newly found free position in the directory for the file
-        if (strcpy(rootDirEntries[dir_pos].filename, filename) == NULL) {
-            fprintf(stderr, "Failed to create file: Failed to copy filename to rootDirEntries[%d].filename", dir_pos);
-            return -1;
+    read_blocks(block, 1, &victim->node);
+    victim->block = block;
+    victim->lastUsed = ++nodeCacheClock;
+    memcpy(node, &victim->node, B);
+}
+
+// Writes an extent tree node, keeping a copy of it in the node cache
+void writeExtentNode(int block, const ExtentNode *node) {
+    write_blocks(block, 1, (void *) node);
+
+    NodeCacheEntry *victim = &nodeCache[0];
+    for (int i = 0; i < NODE_CACHE_SIZE; ++i) {
+        if (nodeCache[i].block == block) {
+            victim = &nodeCache[i];
+            break;
         }
-        rootDirEntries[dir_pos].used = 1;
-        rootDirEntries[dir_pos].inodeNum = (short)dir_pos;
-        inodeTable[rootDirEntries[dir_pos].inodeNum].size = 0;
+        if (nodeCache[i].lastUsed < victim->lastUsed)
+            victim = &nodeCache[i];
+    }
+    memcpy(&victim->node, node, B);
+    victim->block = block;
+    victim->lastUsed = ++nodeCacheClock;
+}
 
-        // Successfully created the entry, now update the root directory on the disk
-        // Write updated inodeTable to disk
-        write_blocks(1, superBlock.inodeTableSize, inodeTable);
-        // Write directory entries to disk (we assume that the data blocks allocated are contiguous and in order)
-        int dirSizeInBlocks = ceil((double)superBlock.rootDir.size / B);
-        write_blocks(superBlock.rootDir.blockPointers[0], dirSizeInBlocks - 1, rootDirEntries);
-    } else { // File exists, need to check if it's already in the FDT
-        for (int i = 0; i < FDT_SIZE; ++i) {
-            if (FDT[i].inodeNum == rootDirEntries[dir_pos].inodeNum) { // File already in the FDT, at pos i
-                return i;
-            }
+// Releases an extent tree node block, dropping it from the node cache since the block may be reused for data
+void freeExtentNode(int block) {
+    for (int i = 0; i < NODE_CACHE_SIZE; ++i) {
+        if (nodeCache[i].block == block) {
+            nodeCache[i].block = 0;
+            nodeCache[i].lastUsed = 0;
         }
+    }
+    sfs_freeDataBlock(block);
+}
 
-        if (fdt_pos < 0) { // File not in FDT, and FDT is full
-            fprintf(stderr, "Failed to open file: The FDT is full.\n");
-            return -1;
+// Appends the data extents of the (sub)tree under `extents` to `*out`, growing it as needed
+int collectExtents(const Extent extents[], int entries, int depth, Extent **out, int *count, int *capacity) {
+    if (depth == 0) {
+        if (*count + entries > *capacity) {
+            int newCapacity = 2 * (*count + entries);
+            Extent *grown = (Extent *) realloc(*out, newCapacity * sizeof(Extent));
+            if (grown == NULL)
+                return -1;
+            *out = grown;
+            *capacity = newCapacity;
         }
+        memcpy(*out + *count, extents, entries * sizeof(Extent));
+        *count += entries;
+        return 0;
     }
 
-    // File not in FDT, but there is space for it, so open the file (add it) in append mode (read/write head at EOF)
-    FDT[fdt_pos].inodeNum = rootDirEntries[dir_pos].inodeNum;
-    FDT[fdt_pos].rwHeadPos = inodeTable[rootDirEntries[dir_pos].inodeNum].size;
-    return fdt_pos;
+    for (int i = 0; i < entries; ++i) {
+        ExtentNode node;
+        readExtentNode(extents[i].physicalStart, &node);
+        if (collectExtents(node.extents, node.header.entries, depth - 1, out, count, capacity) != 0)
+            return -1;
+    }
+    return 0;
 }
 
-int sfs_fclose(int fd) {
-    if (fd < 0 || fd >= FDT_SIZE) {
-        fprintf(stderr, "Failed to close file: the file descriptor is outside the bounds of the FDT.\n");
+// Loads all the extents of an inode into a newly allocated array (with room for `spare` more), returning the count
+int loadExtents(const Inode *inode, Extent **extents, int spare) {
+    int count = 0;
+    int capacity = INODE_EXTENTS + spare;
+    *extents = (Extent *) malloc(capacity * sizeof(Extent));
+    if (*extents == NULL
+        || collectExtents(inode->extents, inodeExtentEntries(inode), inode->header.depth, extents, &count, &capacity)) {
+        fprintf(stderr, "Failed to load extents: ran out of memory.\n");
+        free(*extents);
         return -1;
     }
 
-    if (FDT[fd].inodeNum < 0) {
-        fprintf(stderr, "Failed to close file: the file descriptor has no file associated.\n");
-        return -1;
+    if (capacity < count + spare) {
+        Extent *grown = (Extent *) realloc(*extents, (count + spare) * sizeof(Extent));
+        if (grown == NULL) {
+            fprintf(stderr, "Failed to load extents: ran out of memory.\n");
+            free(*extents);
+            return -1;
+        }
+        *extents = grown;
     }
-
-    // FDT[fd] points to valid open file, close it
-    FDT[fd].inodeNum = -1;
-    return 0;
+    return count;
 }
 
-int sfs_fwrite(int fd, const char *buf, int length) {
-    if (length < 1) {
+// Counts the extent tree node blocks under `extents` (the blocks used by an inode on top of its data blocks)
+int countExtentNodes(const Extent extents[], int entries, int depth) {
+    if (depth == 0)
         return 0;
+
+    int count = entries;
+    for (int i = 0; depth > 1 && i < entries; ++i) {
+        ExtentNode node;
+        readExtentNode(extents[i].physicalStart, &node);
+        count += countExtentNodes(node.extents, node.header.entries, depth - 1);
     }
-    
-    if (fd < 0 || fd >= FDT_SIZE) {
-        fprintf(stderr, "Failed to write to file: the file descriptor is outside the bounds of the FDT.\n");
-        return -1;
+    return count;
+}
+
+// Releases the extent tree node blocks under `extents`
+void freeExtentNodes(const Extent extents[], int entries, int depth) {
+    for (int i = 0; depth > 0 && i < entries; ++i) {
+        if (depth > 1) {
+            ExtentNode node;
+            readExtentNode(extents[i].physicalStart, &node);
+            freeExtentNodes(node.extents, node.header.entries, depth - 1);
+        }
+        freeExtentNode(extents[i].physicalStart);
     }
+}
 
-    if (FDT[fd].inodeNum < 0) {
-        fprintf(stderr, "Failed to write to file: the file descriptor has no file associated.\n");
-        return -1;
+// Replaces the extents of an inode with `extents` (sorted, non-overlapping), rebuilding its extent tree nodes bottom-up
+// The inode is left unchanged if there is not enough space for the new nodes
+int storeExtents(Inode *inode, const Extent extents[], int count) {
+    // Work out the shape of the new tree - add levels of nodes until the top level fits in the inode itself
+    int newNodes = 0;
+    int depth = 0;
+    for (int entries = count; entries > INODE_EXTENTS; entries = (entries + NODE_EXTENTS - 1) / NODE_EXTENTS) {
+        if (++depth > MAX_EXTENT_DEPTH) {
+            fprintf(stderr, "Failed to store extents: the file is too fragmented.\n");
+            return -1;
+        }
+        newNodes += (entries + NODE_EXTENTS - 1) / NODE_EXTENTS;
     }
-    
-    // `FDT[fd]` points to a valid open file
-    Inode inode = inodeTable[FDT[fd].inodeNum];
-    
-    if (FDT[fd].rwHeadPos > inode.size) {
-        fprintf(stderr, "Failed to write to file: the read/write head is beyond the end of the file.\n");
+
+    int oldNodes = countExtentNodes(inode->extents, inodeExtentEntries(inode), inode->header.depth);
+    if (newNodes > oldNodes && sfs_countFreeDataBlocks() < newNodes - oldNodes) {
+        fprintf(stderr, "Failed to store extents: there are not enough free data blocks for the extent tree.\n");
         return -1;
     }
-    
-    if (FDT[fd].rwHeadPos + length > MAX_FILE_SIZE) {
-        fprintf(stderr, "Failed to write to file: the file will exceed the max file size.\n");
+
+    // The index entries of every level are kept one after the other (the top level ends up in the inode)
+    Extent *indexes = (Extent *) malloc((newNodes > 0 ? newNodes : 1) * sizeof(Extent));
+    if (indexes == NULL) {
+        fprintf(stderr, "Failed to store extents: ran out of memory.\n");
         return -1;
     }
-    
-    // Get start and end bytes/blocks
-    int startPos = FDT[fd].rwHeadPos;
-    int endPos = startPos + length;
 
-    int startBlock = startPos / B;
-    int endBlock = endPos / B;
-    
-    int startBlockStartPos = startPos % B;
-    
-    int totalBlocksOld = ceil((double)inode.size / B);
-    int totalBlocksNew = endBlock + 1;
-    
-    int blocksToAdd = totalBlocksNew - totalBlocksOld;
-    int blocksToChange = totalBlocksOld - startBlock;
-    if (totalBlocksOld <= 12 && totalBlocksNew > 12) // Need to include the indirect pointer block itself
-        ++blocksToAdd;
-    
-    if (sfs_countFreeDataBlocks() < blocksToAdd) {
-        fprintf(stderr, "Failed to write to file: there are not enough free data blocks available.\n");
-        return -1;
+    // Release the old nodes
+    freeExtentNodes(inode->extents, inodeExtentEntries(inode), inode->header.depth);
+
+    const Extent *level = extents;
+    int levelEntries = count;
+    Extent *nextLevel = indexes;
+    for (int levelDepth = 0; levelDepth < depth; ++levelDepth) {
+        int nodes = (levelEntries + NODE_EXTENTS - 1) / NODE_EXTENTS;
+        for (int i = 0; i < nodes; ++i) {
+            ExtentNode node;
+            memset(&node, 0, B);
+            int remaining = levelEntries - i * NODE_EXTENTS;
+            node.header.entries = (short)(remaining < NODE_EXTENTS ? remaining : NODE_EXTENTS);
+            node.header.depth = (Byte)levelDepth;
+            memcpy(node.extents, level + i * NODE_EXTENTS, node.header.entries * sizeof(Extent));
+
+            int nodeBlock = sfs_allocateFreeDataBlock();
+            writeExtentNode(nodeBlock, &node);
+
+            // The index entry covers the logical range of the node's entries
+            Extent last = node.extents[node.header.entries - 1];
+            nextLevel[i].logicalStart = node.extents[0].logicalStart;
+            nextLevel[i].physicalStart = nodeBlock;
+            nextLevel[i].length = last.logicalStart + last.length - node.extents[0].logicalStart;
+        }
+        level = nextLevel;
+        levelEntries = nodes;
+        nextLevel += nodes;
     }
 
-    // Gather pointers to relevant blocks (existing blocks to change + new blocks to add)
-    int blocksToWrite = blocksToChange + blocksToAdd; // Existing blocks + blocksToAdd
-    int blocksToWriteDataTo = blocksToWrite;
-    if (totalBlocksOld <= 12 && totalBlocksNew > 12)
-        --blocksToWriteDataTo;
-    int blocksToWritePointers[blocksToWrite];
-    
-    if (blocksToChange == 0) { // All blocks in `blocksToWriteToPointers` need to be added
-        // Get new blocks
-        for (int i = 0; i < blocksToWrite; ++i) {
-            int newBlock = sfs_allocateFreeDataBlock();
-            if (newBlock < 0) {
-                fprintf(stderr, "Failed to write to file: failed to get free data blocks.\n");
-                for (int j = i - 1; j > blocksToChange; --j) {
-                    clearBit(fbm, blocksToWritePointers[j]);
-                }
-                return -1;
-            }
-            blocksToWritePointers[i] = newBlock;
+    memset(inode->extents, 0, sizeof(inode->extents));
+    if (levelEntries > 0)
+        memcpy(inode->extents, level, levelEntries * sizeof(Extent));
+    inode->header.entries = (short)levelEntries;
+    inode->header.depth = (Byte)depth;
+    inode->header.flags &= ~INODE_INLINE_DATA;
+    free(indexes);
+    return 0;
+}
+
+// Comparator for sorting extents by their first logical block
+int compareExtents(const void *a, const void *b) {
+    return ((const Extent *) a)->logicalStart - ((const Extent *) b)->logicalStart;
+}
+
+// Adds a node to the nodes changed by an extent tree update (NULL if out of memory). The nodes come from `pendingPool`,
+// and only from the heap for the updates that change more nodes than it holds.
+PendingNode *addPendingNode(PendingNode **pending, int block) {
+    PendingNode *pendingNode;
+    if (pendingPoolUsed < PENDING_POOL_SIZE) {
+        pendingNode = &pendingPool[pendingPoolUsed++];
+        memset(pendingNode, 0, sizeof(PendingNode));
+    } else {
+        pendingNode = (PendingNode *) calloc(1, sizeof(PendingNode));
+        if (pendingNode == NULL)
+            return NULL;
+        pendingNode->fromHeap = 1;
+    }
+    pendingNode->block = block;
+    pendingNode->next = *pending;
+    *pending = pendingNode;
+    return pendingNode;
+}
+
+// Ends an extent tree update - nothing is written until then, so if it failed the nodes it allocated are simply released,
+// otherwise the nodes it changed are written and the ones it emptied released
+void finishExtentUpdate(PendingNode *pending, int succeeded) {
+    while (pending != NULL) {
+        PendingNode *next = pending->next;
+        if (succeeded && pending->released)
+            freeExtentNode(pending->block);
+        else if (succeeded)
+            writeExtentNode(pending->block, &pending->node);
+        else if (pending->allocated)
+            sfs_freeDataBlock(pending->block);
+        if (pending->fromHeap)
+            free(pending);
+        pending = next;
+    }
+    pendingPoolUsed = 0;
+}
+
+// Packs `count` entries of a level of the tree into as few nodes as they fit in (spread evenly, so that a node that is
+// split leaves room in both halves), and fills `index` with an index entry per node. The first node goes in `block` (if
+// not 0) and the others in new blocks. Returns the number of nodes, -1 if there is no space for them
+int packExtentNodes(const Extent extents[], int count, int depth, int block, Extent index[], PendingNode **pending) {
+    int nodes = (count + NODE_EXTENTS - 1) / NODE_EXTENTS;
+    int packed = 0;
+    for (int i = 0; i < nodes; ++i) {
+        int allocated = i > 0 || block == 0;
+        int nodeBlock = allocated ? sfs_allocateFreeDataBlock() : block;
+        if (nodeBlock < 0) {
+            fprintf(stderr, "Failed to store extents: there are not enough free data blocks for the extent tree.\n");
+            return -1;
         }
-    } else { // Need to write in existing blocks
-        int *existingBlocksPointers = (int *) malloc(totalBlocksOld * sizeof(int));
-        if (existingBlocksPointers == NULL) {
-            fprintf(stderr, "Failed to write to file: ran out of memory while trying to get existing blocks.\n");
+        PendingNode *pendingNode = addPendingNode(pending, nodeBlock);
+        if (pendingNode == NULL) {
+            fprintf(stderr, "Failed to store extents: ran out of memory.\n");
+            if (allocated)
+                sfs_freeDataBlock(nodeBlock);
             return -1;
         }
+        pendingNode->allocated = allocated;
+
+        ExtentNode *node = &pendingNode->node;
+        node->header.entries = (short)(count / nodes + (i < count % nodes));
+        node->header.depth = (Byte)depth;
+        memcpy(node->extents, extents + packed, node->header.entries * sizeof(Extent));
+        packed += node->header.entries;
+
+        // The index entry covers the logical range of the node's entries
+        Extent last = node->extents[node->header.entries - 1];
+        index[i].logicalStart = node->extents[0].logicalStart;
+        index[i].physicalStart = nodeBlock;
+        index[i].length = last.logicalStart + last.length - node->extents[0].logicalStart;
+    }
+    return nodes;
+}
+
+// Replaces the mappings of blocks [firstBlock, endBlock) in the data extents `in` with `runs` (sorted, within the range),
+// merging the extents that end up contiguous both logically and physically. Returns the number of extents in `*out`
+// (in scratch memory), -1 if out of scratch memory
+int remapExtents(const Extent in[], int inCount, int firstBlock, int endBlock, const Extent runs[], int runCount,
+                 Extent **out) {
+    // The extents kept and the runs map distinct blocks, so there are never more of them than data blocks (plus the one
+    // an extent spanning the whole range is split into)
+    int capacity = inCount + runCount + 1 < superBlock.dataBlocksCount + 1 ? inCount + runCount + 1
+                                                                           : superBlock.dataBlocksCount + 1;
+    Extent *extents = (Extent *) scratchAlloc(capacity * sizeof(Extent));
+    if (extents == NULL) {
+        fprintf(stderr, "Failed to store extents: ran out of scratch memory.\n");
+        return -1;
+    }
 
-        getInodeBlockPointers(inode, existingBlocksPointers, totalBlocksOld);
-        int i = 0;
-        // Get required existing blocks
-        for (; i < blocksToChange; ++i) {
-            blocksToWritePointers[i] = existingBlocksPointers[startBlock + i];
+    // Cut the range out of the existing extents (an extent spanning the whole range is split in 2)
+    int kept = 0;
+    for (int i = 0; i < inCount; ++i) {
+        Extent e = in[i];
+        int eEnd = e.logicalStart + e.length;
+        if (eEnd <= firstBlock || e.logicalStart >= endBlock) {
+            extents[kept++] = e;
+            continue;
         }
-        // Get new blocks
-        for (; i < blocksToWrite; ++i) {
-            int newBlock = sfs_allocateFreeDataBlock();
-            if (newBlock < 0) {
-                fprintf(stderr, "Failed to write to file: failed to get free data blocks.\n");
-                for (int j = i - 1; j > blocksToChange; --j) {
-                    clearBit(fbm, blocksToWritePointers[j]);
-                }
-                return -1;
-            }
-            blocksToWritePointers[i] = newBlock;
+        if (e.logicalStart < firstBlock) { // Keep the head
+            Extent head = { e.logicalStart, e.physicalStart, firstBlock - e.logicalStart };
+            extents[kept++] = head;
+        }
+        if (eEnd > endBlock) { // Keep the tail
+            Extent tail = { endBlock, e.physicalStart + (endBlock - e.logicalStart), eEnd - endBlock };
+            extents[kept++] = tail;
         }
-        free(existingBlocksPointers);
     }
 
-    // Create a new buffer that includes potential existing data in the start and end blocks
-    Byte newBuf[blocksToWriteDataTo * B];
-    if (blocksToChange > 0) { // Copy data from `startBlock` to the front of `newBuf`
-        read_blocks(blocksToWritePointers[0], 1, newBuf);
-    }
-    if (blocksToChange == blocksToWrite && startBlock != endBlock) { // Copy data from `endBlock` to the end of `newBuf`
-        read_blocks(blocksToWritePointers[blocksToWrite - 1], 1, newBuf + (blocksToWrite - 1) * B);
+    // Add the new mappings, sort, then merge the extents that are contiguous both logically and physically
+    if (runCount > 0)
+        memcpy(extents + kept, runs, runCount * sizeof(Extent));
+    kept += runCount;
+    qsort(extents, kept, sizeof(Extent), compareExtents);
+    int merged = 0;
+    for (int i = 0; i < kept; ++i) {
+        if (merged > 0) {
+            Extent *prev = &extents[merged - 1];
+            if (prev->logicalStart + prev->length == extents[i].logicalStart
+                && prev->physicalStart + prev->length == extents[i].physicalStart) {
+                prev->length += extents[i].length;
+                continue;
+            }
+        }
+        extents[merged++] = extents[i];
     }
+    *out = extents;
+    return merged;
+}
 
-    // Copy `buf` into `newBuf`, in between existing data from `startBlock` and `endBlock`
-    for (int i = 0; i < length; ++i) {
-        newBuf[startBlockStartPos + i] = buf[i];
+// Applies an extent tree update (see updateExtentTree()) to a level of the tree: the `inCount` entries `in` at `depth`.
+// Only the children whose range is touched are read and changed (their nodes are split if they overflow, and released
+// if they end up empty). Returns the number of entries of the level in `*out` (in scratch memory, which the caller
+// releases), -1 on failure
+int updateExtentLevel(const Extent in[], int inCount, int depth, int firstBlock, int endBlock, const Extent runs[],
+                      int runCount, Extent **out, PendingNode **pending) {
+    if (depth == 0)
+        return remapExtents(in, inCount, firstBlock, endBlock, runs, runCount, out);
+
+    // The entries of the level are distinct node blocks, so there are never more of them than data blocks
+    int capacity = superBlock.dataBlocksCount + 1;
+    int count = 0;
+    Extent *level = (Extent *) scratchAlloc(capacity * sizeof(Extent));
+    int levelMark = scratchUsed;
+    Extent *childRuns = (Extent *) scratchAlloc((runCount > 0 ? runCount : 1) * sizeof(Extent));
+    if (level == NULL || childRuns == NULL) {
+        fprintf(stderr, "Failed to store extents: ran out of scratch memory.\n");
+        return -1;
     }
 
-    // Write the buffer to disk
-    // The block needed to write the indirect pointers is at the last index of `blocksToWrite` (if it's needed)
-    for (int i = 0; i < blocksToWriteDataTo; ++i) {
-        write_blocks(blocksToWritePointers[i], 1, newBuf + (i * B));
-    }
+    for (int i = 0; i < inCount; ++i) {
+        // Each child covers the blocks from its first one up to the first one of the next child (the first and last
+        // children also cover everything before and after them), so the new runs are split between the children
+        int from = i == 0 || in[i].logicalStart < firstBlock ? firstBlock : in[i].logicalStart;
+        int to = i == inCount - 1 || in[i + 1].logicalStart > endBlock ? endBlock : in[i + 1].logicalStart;
+        int childRunCount = 0;
+        for (int j = 0; j < runCount; ++j) {
+            int runFrom = runs[j].logicalStart > from ? runs[j].logicalStart : from;
+            int runTo = runs[j].logicalStart + runs[j].length < to ? runs[j].logicalStart + runs[j].length : to;
+            if (runFrom < runTo) {
+                Extent run = { runFrom, runs[j].physicalStart + (runFrom - runs[j].logicalStart), runTo - runFrom };
+                childRuns[childRunCount++] = run;
+            }
+        }
 
-    // Update the inode data
-    // and update the availability of the newly allocated data blocks on the free bitmap
-    if (blocksToAdd > 0) { // New blocks were added, need to update inode pointer data
-        int i = 0;
-        // Update direct pointers
-        for (; i < blocksToWriteDataTo && startBlock + i < 12; ++i) {
-            inode.blockPointers[startBlock + i] = blocksToWritePointers[i];
+        // Children that have nothing to cut out nor add are kept as they are, without even reading them
+        int cut = from < to && from < in[i].logicalStart + in[i].length && to > in[i].logicalStart;
+        if (!cut && childRunCount == 0) {
+            level[count++] = in[i];
+            continue;
         }
 
-        // Update indirect pointer block & the pointer to it (if necessary)
-        if (endBlock > 11) {
-            int indirectBlockPointers[B / sizeof(int)];
-            // Load the indirect pointer block if it already exists
-            if (totalBlocksOld > 12)
-                read_blocks(inode.blockPointers[12], 1, indirectBlockPointers);
+        int childMark = scratchUsed;
+        ExtentNode node;
+        readExtentNode(in[i].physicalStart, &node);
+        Extent *child;
+        int childCount = updateExtentLevel(node.extents, node.header.entries, depth - 1, from, to, childRuns,
+                                           childRunCount, &child, pending);
+        if (childCount < 0)
+            return -1;
 
-            // Update indirect pointers
-            for (; i < blocksToWriteDataTo; ++i) {
-                indirectBlockPointers[startBlock + i - 12] = blocksToWritePointers[i];
-            }
+        int nodes = (childCount + NODE_EXTENTS - 1) / NODE_EXTENTS;
+        if (count + nodes + (inCount - i - 1) > capacity) {
+            fprintf(stderr, "Failed to store extents: the file is too fragmented.\n");
+            return -1;
+        }
 
-            if (totalBlocksOld <= 12) { // Pointer to indirect block needs to be updated
-                inode.blockPointers[12] = blocksToWritePointers[i];
-            }
-            // Write new/updated indirect pointer block to disk
-            write_blocks(inode.blockPointers[12], 1, indirectBlockPointers);
+        int res;
+        if (childCount == 0) { // The child is empty, release its node
+            PendingNode *pendingNode = addPendingNode(pending, in[i].physicalStart);
+            if (pendingNode != NULL)
+                pendingNode->released = 1;
+            else
+                fprintf(stderr, "Failed to store extents: ran out of memory.\n");
+            res = pendingNode != NULL ? 0 : -1;
+        } else { // The child is rewritten in place, and split into new nodes if it overflows
+            res = packExtentNodes(child, childCount, depth - 1, in[i].physicalStart, level + count, pending);
         }
+        scratchUsed = childMark; // Release the child's entries
+        if (res < 0)
+            return -1;
+        count += nodes;
     }
 
-    // Update the read/write head position and inode size (only if the write caused the file to increase in size)
-    FDT[fd].rwHeadPos += length;
-    if (FDT[fd].rwHeadPos > inode.size)
-        inode.size = FDT[fd].rwHeadPos;
-    
-    // Update the inode in `inodeTable` and write the updated inodeTable back to disk
-    inodeTable[FDT[fd].inodeNum] = inode;
-    write_blocks(1, superBlock.inodeTableSize, inodeTable);
-    
-    // Write the updated free bitmap back to disk
-    write_blocks(superBlock.sfsSize - superBlock.fbmSize - 1, superBlock.fbmSize, fbm);
-    
-    return length;
+    scratchUsed = levelMark; // Release the runs, and keep the level for the caller
+    *out = level;
+    return count;
 }
 
-int sfs_fread(int fd, char *buf, int length) {
-    if (fd < 0 || fd >= FDT_SIZE) {
-        fprintf(stderr, "Failed to read file: the file descriptor is outside the bounds of the FDT.\n");
+// Replaces the mappings of blocks [firstBlock, endBlock) of an inode with `runs` (sorted, within the range). Only the
+// extent tree nodes on the path to the range are read and rewritten: a node is split when it overflows, and the tree
+// grows a level when the inode itself does (or shrinks one when the top node fits in the inode again). The inode is
+// left unchanged and nothing is written if there is not enough space for new nodes
+int updateExtentTree(Inode *inode, int firstBlock, int endBlock, const Extent runs[], int runCount) {
+    PendingNode *pending = NULL;
+    Extent *top;
+    int scratchMark = scratchUsed;
+    int depth = inodeExtentEntries(inode) > 0 ? inode->header.depth : 0;
+    int entries = updateExtentLevel(inode->extents, inodeExtentEntries(inode), depth, firstBlock, endBlock, runs,
+                                    runCount, &top, &pending);
+    if (entries < 0) {
+        finishExtentUpdate(pending, 0);
+        scratchUsed = scratchMark;
         return -1;
     }
 
-    if (FDT[fd].inodeNum < 0) {
-        fprintf(stderr, "Failed to read file: the file descriptor has no file associated.\n");
-        return -1;
-    }
-    
-    // FDT[fd] points to valid open file
-    Inode inode = inodeTable[FDT[fd].inodeNum];
-    
-    // Reduce length of read if EOF is closer than FDT[fd].rwHeadPos + length
-    if (FDT[fd].rwHeadPos + length > inode.size) {
-        length = inode.size - FDT[fd].rwHeadPos;
-        if (length <= 0) {
-            return 0;
+    // Add levels of nodes until the top level fits in the inode
+    while (entries > INODE_EXTENTS) {
+        if (depth == MAX_EXTENT_DEPTH) {
+            fprintf(stderr, "Failed to store extents: the file is too fragmented.\n");
+            finishExtentUpdate(pending, 0);
+            scratchUsed = scratchMark;
+            return -1;
+        }
+        Extent *index = (Extent *) scratchAlloc((entries + NODE_EXTENTS - 1) / NODE_EXTENTS * sizeof(Extent));
+        int nodes = index != NULL ? packExtentNodes(top, entries, depth, 0, index, &pending) : -1;
+        if (nodes < 0) {
+            if (index == NULL)
+                fprintf(stderr, "Failed to store extents: ran out of scratch memory.\n");
+            finishExtentUpdate(pending, 0);
+            scratchUsed = scratchMark;
+            return -1;
         }
+        top = index;
+        entries = nodes;
+        ++depth;
     }
-    
-    // Get start and end blocks
-    int startBlock = FDT[fd].rwHeadPos / B;
-    int endBlock = (FDT[fd].rwHeadPos + length) / B;
 
-    int existingBlocksPointers[endBlock + 1];
-    getInodeBlockPointers(inode, existingBlocksPointers, endBlock + 1);
-    
-    // Load all the blocks from startBlock to endBlock
-    Byte loadedBlocksData[(endBlock - startBlock + 1) * B];
-    Byte *currentBlockData = (Byte *) malloc(B);
-    for (int i = startBlock; i <= endBlock; ++i) {
-        read_blocks(existingBlocksPointers[i], 1, currentBlockData);
-        for (int j = 0; j < B; ++j) {
-            loadedBlocksData[(i - startBlock) * B + j] = currentBlockData[j];
+    // Drop levels while the inode has a single child whose entries fit in the inode (or no child at all)
+    Extent inodeExtents[INODE_EXTENTS];
+    memcpy(inodeExtents, top, entries * sizeof(Extent));
+    scratchUsed = scratchMark;
+    while (depth > 0 && entries <= 1) {
+        if (entries == 0) {
+            depth = 0;
+            break;
         }
+        PendingNode *child = pending;
+        while (child != NULL && child->block != inodeExtents[0].physicalStart)
+            child = child->next;
+        ExtentNode node;
+        if (child != NULL)
+            memcpy(&node, &child->node, B);
+        else
+            readExtentNode(inodeExtents[0].physicalStart, &node);
+        if (node.header.entries > INODE_EXTENTS)
+            break;
+        if (child == NULL)
+            child = addPendingNode(&pending, inodeExtents[0].physicalStart);
+        if (child == NULL) // Out of memory, keep the extra level
+            break;
+        child->released = 1;
+        entries = node.header.entries;
+        memcpy(inodeExtents, node.extents, entries * sizeof(Extent));
+        --depth;
     }
-    free(currentBlockData);
 
-    int startBlockStartPos = FDT[fd].rwHeadPos % B;
-    for (int j = 0; j < length; ++j) {
-        buf[j] = loadedBlocksData[startBlockStartPos + j];
+    finishExtentUpdate(pending, 1);
+    memset(inode->extents, 0, sizeof(inode->extents));
+    memcpy(inode->extents, inodeExtents, entries * sizeof(Extent));
+    inode->header.entries = (short)entries;
+    inode->header.depth = (Byte)depth;
+    inode->header.flags &= ~INODE_INLINE_DATA;
+    return 0;
+}
+
+// Decodes the block map of the file open at `fd` from the inode's extent tree, unless it is already cached (the map is
+// shared by all the descriptors the file is open in)
+int loadBlockMap(int fd) {
+    OpenFile *openFile = FDT[fd].openFile;
+    if (openFile->blockMap == NULL) {
+        int entries = loadExtents(&inodeTable[openFile->inodeNum], &openFile->blockMap, 0);
+        if (entries < 0) {
+            openFile->blockMap = NULL;
+            return -1;
+        }
+        openFile->blockMapEntries = entries;
+        openFile->blockMapCapacity = entries;
     }
-    
-    FDT[fd].rwHeadPos += length;
-    return length;
+    return 0;
 }
 
-int sfs_fseek(int fd, int loc) {
-    if (fd < 0 || fd >= FDT_SIZE) {
-        fprintf(stderr, "Failed to seek in file: the file descriptor is outside the bounds of the FDT.\n");
+// Gets the data block pointers of the open file at `fd` (the `blocksToGet` blocks from `firstBlock`) from its cached
+// block map, decoding the map from the inode's extent tree the first time
+int getFileBlockPointers(int fd, int pointers[], int firstBlock, int blocksToGet) {
+    if (loadBlockMap(fd) != 0)
+        return -1;
+
+    memset(pointers, 0, blocksToGet * sizeof(int)); // Unmapped blocks (holes, or past the end of the file) are left as 0
+    mapExtents(FDT[fd].openFile->blockMap, FDT[fd].openFile->blockMapEntries, pointers, firstBlock, blocksToGet);
+    return blocksToGet;
+}
+
+// Drops the blocks prefetched for inode `inodeNum`, to be called whenever the data of the inode changes
+void dropReadAhead(int inodeNum) {
+    if (inodeNum >= 0 && openFiles[inodeNum] != NULL)
+        openFiles[inodeNum]->readAheadBlocks = 0;
+}
+
+// Gets the data of logical block `block` of an open file from its read-ahead buffer (NULL if it wasn't prefetched)
+Byte *readAheadBlock(const OpenFile *openFile, int block) {
+    if (block < openFile->readAheadStart || block >= openFile->readAheadStart + openFile->readAheadBlocks)
+        return NULL;
+    return openFile->readAhead + (block - openFile->readAheadStart) * B;
+}
+
+// Prefetches the blocks from the one at `offset` on into the read-ahead buffer of the file open at `fd`, unless the
+// buffer already holds every block that reading `length` bytes at `offset` needs. The window is `READ_AHEAD_MIN_BLOCKS`
+// for the first sequential read, and doubles with each sequential read after it up to `READ_AHEAD_MAX_BLOCKS`.
+void readAhead(int fd, int offset, int length) {
+    OpenFile *openFile = FDT[fd].openFile;
+    const Inode *inode = &inodeTable[openFile->inodeNum];
+    if (inode->header.flags & INODE_INLINE_DATA || length <= 0 || offset >= inode->size)
+        return;
+
+    int firstBlock = offset / B;
+    int endPos = offset + length < inode->size ? offset + length : inode->size;
+    int lastBlock = (endPos - 1) / B;
+    if (readAheadBlock(openFile, lastBlock) != NULL) // The read is already covered
+        return;
+
+    int window = READ_AHEAD_MIN_BLOCKS;
+    for (int i = 1; i < FDT[fd].sequentialReads && window < READ_AHEAD_MAX_BLOCKS; ++i)
+        window *= 2;
+    if (window > READ_AHEAD_MAX_BLOCKS)
+        window = READ_AHEAD_MAX_BLOCKS;
+    if (lastBlock - firstBlock + 1 > window) // Reads larger than the window are better off read directly
+        return;
+    int fileBlocks = (inode->size + B - 1) / B;
+    int blocks = fileBlocks - firstBlock < window ? fileBlocks - firstBlock : window;
+
+    if (openFile->readAhead == NULL && (openFile->readAhead = (Byte *) malloc(READ_AHEAD_MAX_BLOCKS * B)) == NULL)
+        return;
+
+    // Keep the blocks of the current window from `firstBlock` on, and read the rest
+    int kept = 0;
+    if (readAheadBlock(openFile, firstBlock) != NULL) {
+        kept = openFile->readAheadStart + openFile->readAheadBlocks - firstBlock;
+        memmove(openFile->readAhead, readAheadBlock(openFile, firstBlock), kept * B);
+    }
+    openFile->readAheadBlocks = 0;
+
+    int scratchMark = scratchUsed;
+    int *pointers = (int *) scratchAlloc(READ_AHEAD_MAX_BLOCKS * sizeof(int));
+    if (pointers == NULL || getFileBlockPointers(fd, pointers, firstBlock + kept, blocks - kept) < 0) {
+        scratchUsed = scratchMark;
+        return;
+    }
+    for (int i = 0; i < blocks - kept;) {
+        Byte *dest = openFile->readAhead + (kept + i) * B;
+        int run = 1;
+        while (i + run < blocks - kept && pointers[i + run] == (pointers[i] == 0 ? 0 : pointers[i] + run))
+            ++run;
+        if (pointers[i] == 0) // A hole, which reads back as zeros
+            memset(dest, 0, run * B);
+        else
+            read_blocks(pointers[i], run, dest);
+        i += run;
+    }
+    scratchUsed = scratchMark;
+
+    openFile->readAheadStart = firstBlock;
+    openFile->readAheadBlocks = blocks;
+}
+
+// Gets the address of byte `pos` of the data described by `iov` (its buffers one after the other), and the number of
+// bytes from there to the end of the buffer holding it in `contiguous` (NULL and 0 if `pos` is past the end)
+char *iovecAt(const SfsIovec iov[], int iovcnt, int pos, int *contiguous) {
+    for (int i = 0; i < iovcnt; ++i) {
+        if (pos < iov[i].length) {
+            *contiguous = iov[i].length - pos;
+            return (char *) iov[i].base + pos;
+        }
+        pos -= iov[i].length;
+    }
+    *contiguous = 0;
+    return NULL;
+}
+
+// Copies `length` bytes between `buf` and the data described by `iov` from byte `pos` on: into the buffers of `iov` if
+// `toIovec` (zeros if `buf` is NULL), out of them otherwise
+void copyIovec(const SfsIovec iov[], int iovcnt, int pos, char *buf, int length, int toIovec) {
+    while (length > 0) {
+        int contiguous;
+        char *data = iovecAt(iov, iovcnt, pos, &contiguous);
+        if (data == NULL)
+            return;
+        int n = contiguous < length ? contiguous : length;
+        if (!toIovec)
+            memcpy(buf, data, n);
+        else if (buf == NULL)
+            memset(data, 0, n);
+        else
+            memcpy(data, buf, n);
+        pos += n;
+        length -= n;
+        if (buf != NULL)
+            buf += n;
+    }
+}
+
+// Adds up the lengths of the buffers described by `iov`, returning -1 if any of them is negative or the total overflows
+int iovecLength(const SfsIovec iov[], int iovcnt) {
+    int length = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        if (iov[i].length < 0 || iov[i].length > INT_MAX - length)
+            return -1;
+        length += iov[i].length;
+    }
+    return length;
+}
+
+// Copies the `length` bytes described by `iov`, just written to inode `inodeNum` at `offset`, into the shared mappings
+// of the range, so that they see the writes made through descriptors (private mappings are a snapshot)
+void updateMappings(int inodeNum, const SfsIovec iov[], int iovcnt, int offset, int length) {
+    for (Mapping *mapping = mappings; mapping != NULL; mapping = mapping->next) {
+        int mappingEnd = mapping->offset + mapping->length;
+        int from = offset > mapping->offset ? offset : mapping->offset;
+        int to = offset + length < mappingEnd ? offset + length : mappingEnd;
+        if (mapping->flags != SFS_MAP_SHARED || FDT[mapping->fd].inodeNum != inodeNum || from >= to)
+            continue;
+        int contiguous;
+        if (iovecAt(iov, iovcnt, from - offset, &contiguous) == (char *) mapping->data + (from - mapping->offset))
+            continue; // The mapping is the data written (sfs_msync() writing it back)
+        copyIovec(iov, iovcnt, from - offset, (char *) mapping->data + (from - mapping->offset), to - from, 0);
+    }
+}
+
+// Finds the mapping that holds address `addr`, and the link pointing to it in `mappings` (NULL if there is none)
+Mapping **findMapping(const void *addr) {
+    for (Mapping **link = &mappings; *link != NULL; link = &(*link)->next) {
+        const Byte *data = (*link)->data;
+        if ((const Byte *) addr >= data && (const Byte *) addr < data + (*link)->length)
+            return link;
+    }
+    return NULL;
+}
+
+// Writes the first `length` bytes of the write buffer of descriptor `fd` to the file, keeping the rest buffered
+int flushWriteBuffer(int fd, int length) {
+    File *file = &FDT[fd];
+    if (file->writeBufferLength == 0)
+        return 0;
+
+    file->openFile->bufferedFd = -1; // So that sfs_pwrite() doesn't try to flush the buffer itself
+    if (sfs_pwrite(fd, file->writeBuffer, length, file->writeBufferStart) != length) {
+        file->openFile->bufferedFd = fd;
+        return -1;
+    }
+    file->writeBufferLength -= length;
+    file->writeBufferStart += length;
+    memmove(file->writeBuffer, file->writeBuffer + length, file->writeBufferLength);
+    if (file->writeBufferLength > 0)
+        file->openFile->bufferedFd = fd;
+    return 0;
+}
+
+// Writes the appends buffered for inode `inodeNum` (by whichever descriptor holds them) to the file, to be called
+// before the inode's size or data is used
+int flushInodeWrites(int inodeNum) {
+    if (inodeNum < 0 || openFiles[inodeNum] == NULL || openFiles[inodeNum]->bufferedFd < 0)
+        return 0;
+    int fd = openFiles[inodeNum]->bufferedFd;
+    return flushWriteBuffer(fd, FDT[fd].writeBufferLength);
+}
+
+// Drops the appends buffered for inode `inodeNum` without writing them, for when the file is removed
+void discardInodeWrites(int inodeNum) {
+    if (inodeNum < 0 || openFiles[inodeNum] == NULL || openFiles[inodeNum]->bufferedFd < 0)
+        return;
+    FDT[openFiles[inodeNum]->bufferedFd].writeBufferLength = 0;
+    openFiles[inodeNum]->bufferedFd = -1;
+}
+
+// Gathers a small append (up to `WRITE_BUFFER_BLOCKS - 1` blocks) at the read/write head of descriptor `fd` in its write
+// buffer. Once the buffer is full, the whole blocks in it are written and only the partial last block stays buffered,
+// so appends are written in whole blocks. Returns `length` if the data was buffered, 0 if it should be written directly
+// (it is too large, or isn't an append), or -1 if the buffered data couldn't be written.
+int bufferWrite(int fd, const char *buf, int length) {
+    File *file = &FDT[fd];
+    int capacity = WRITE_BUFFER_BLOCKS * B;
+    if (!file->writeBuffering || length > capacity - B || file->rwHeadPos > INT_MAX - length)
+        return 0; // Not buffered (a write ending past the largest file size is rejected by sfs_pwrite())
+
+    int offset = file->rwHeadPos;
+    if (file->writeBufferLength == 0 || offset != file->writeBufferStart + file->writeBufferLength) {
+        // Not a continuation of the buffered appends, so start over once they're written (along with those buffered
+        // by other descriptors of the file, which would change its size)
+        if (flushInodeWrites(file->inodeNum) != 0 || (file->writeBufferLength > 0 && flushWriteBuffer(fd, file->writeBufferLength) != 0))
+            return -1;
+        if (offset < inodeTable[file->inodeNum].size) // Not an append
+            return 0;
+        if (file->writeBuffer == NULL && (file->writeBuffer = (Byte *) malloc(capacity)) == NULL)
+            return 0;
+        file->writeBufferStart = offset;
+    }
+
+    if (file->writeBufferLength + length > capacity) {
+        // Write the whole blocks buffered (the buffer holds over a block, so it ends past a block boundary)
+        int end = file->writeBufferStart + file->writeBufferLength;
+        if (flushWriteBuffer(fd, end / B * B - file->writeBufferStart) != 0)
+            return -1;
+    }
+    memcpy(file->writeBuffer + file->writeBufferLength, buf, length);
+    file->writeBufferLength += length;
+    file->openFile->bufferedFd = fd;
+    return length;
+}
+
+// Drops the cached block maps of inode `inodeNum`, to be called whenever the blocks of the inode change
+void invalidateBlockMaps(int inodeNum) {
+    if (inodeNum >= 0 && openFiles[inodeNum] != NULL) {
+        free(openFiles[inodeNum]->blockMap);
+        openFiles[inodeNum]->blockMap = NULL;
+    }
+    dropReadAhead(inodeNum);
+
+    Directory *dir = inodeNum == ROOT_DIR_INODE ? &rootDir : (inodeNum >= 0 ? dirCache[inodeNum] : NULL);
+    if (dir != NULL) {
+        free(dir->blockMap);
+        dir->blockMap = NULL;
+    }
+}
+
+// Turns the mappings of the `count` blocks from `firstBlock` to the absolute addresses in `pointers` (0 for unmapped
+// blocks) into runs of physically contiguous blocks, returning the number of runs
+int pointersToRuns(const int pointers[], int firstBlock, int count, Extent runs[]) {
+    int runCount = 0;
+    for (int i = 0; i < count;) {
+        if (pointers[i] == 0) {
+            ++i;
+            continue;
+        }
+        int runLength = 1;
+        while (i + runLength < count && pointers[i + runLength] == pointers[i] + runLength)
+            ++runLength;
+        Extent run = { firstBlock + i, pointers[i], runLength };
+        runs[runCount++] = run;
+        i += runLength;
+    }
+    return runCount;
+}
+
+// Maps the `count` blocks from `firstBlock` of an inode to the absolute addresses in `pointers` (0 to unmap a block),
+// merging them with the inode's existing extents (only the part of the extent tree covering the range is rewritten)
+int setInodeBlockPointers(Inode *inode, const int pointers[], int firstBlock, int count) {
+    int scratchMark = scratchUsed;
+    Extent *runs = (Extent *) scratchAlloc((count > 0 ? count : 1) * sizeof(Extent));
+    if (runs == NULL) {
+        fprintf(stderr, "Failed to store extents: ran out of scratch memory.\n");
+        return -1;
+    }
+    int runCount = pointersToRuns(pointers, firstBlock, count, runs);
+    int res = updateExtentTree(inode, firstBlock, firstBlock + count, runs, runCount);
+    scratchUsed = scratchMark;
+    return res;
+}
+
+// Applies an extent tree update (see updateExtentTree()) to the cached block map of an open file (if it has one), so
+// that it doesn't have to be decoded from the extent tree again
+void remapBlockMap(OpenFile *openFile, int firstBlock, int endBlock, const Extent runs[], int runCount) {
+    if (openFile == NULL || openFile->blockMap == NULL)
+        return;
+    int scratchMark = scratchUsed;
+    Extent *blockMap;
+    int entries = remapExtents(openFile->blockMap, openFile->blockMapEntries, firstBlock, endBlock, runs, runCount,
+                               &blockMap);
+    if (entries > openFile->blockMapCapacity) { // Grow the map geometrically, appends add an extent at a time
+        Extent *grown = (Extent *) realloc(openFile->blockMap, 2 * entries * sizeof(Extent));
+        if (grown != NULL) {
+            openFile->blockMap = grown;
+            openFile->blockMapCapacity = 2 * entries;
+        } else {
+            entries = -1;
+        }
+    }
+    if (entries >= 0) {
+        memcpy(openFile->blockMap, blockMap, entries * sizeof(Extent));
+        openFile->blockMapEntries = entries;
+    } else { // Decoded again on next use if it couldn't be updated
+        free(openFile->blockMap);
+        openFile->blockMap = NULL;
+        openFile->blockMapEntries = 0;
+    }
+    scratchUsed = scratchMark;
+}
+
+// Releases all the data blocks and extent tree nodes of an inode
+void freeInodeBlocks(Inode *inode) {
+    Extent *extents;
+    int entries = loadExtents(inode, &extents, 0);
+    for (int i = 0; i < entries; ++i) {
+        for (int j = 0; j < extents[i].length; ++j) {
+            sfs_freeDataBlock(extents[i].physicalStart + j);
+        }
+    }
+    if (entries >= 0)
+        free(extents);
+    storeExtents(inode, NULL, 0);
+}
+
+// Writes the inode table block(s) holding inode `inodeNum` back to disk (an inode can be split over 2 blocks)
+void writeInode(int inodeNum) {
+    if (inodeNum < BASE_INODES) {
+        int firstBlock = (inodeNum * sizeof(Inode)) / B;
+        int lastBlock = ((inodeNum + 1) * sizeof(Inode) - 1) / B;
+        write_blocks(1 + firstBlock, lastBlock - firstBlock + 1, (Byte *) inodeTable + firstBlock * B);
+        return;
+    }
+
+    // The inode is in the part of the table that grew into the data blocks, which may not be contiguous
+    Byte *extData = (Byte *) (inodeTable + BASE_INODES);
+    int firstBlock = ((inodeNum - BASE_INODES) * sizeof(Inode)) / B;
+    int lastBlock = ((inodeNum - BASE_INODES + 1) * sizeof(Inode) - 1) / B;
+    int pointers[2];
+    memset(pointers, 0, sizeof(pointers));
+    mapExtents(inodeTableExtMap, inodeTableExtMapEntries, pointers, firstBlock, lastBlock - firstBlock + 1);
+    for (int i = firstBlock; i <= lastBlock; ++i) {
+        write_blocks(pointers[i - firstBlock], 1, extData + i * B);
+    }
+}
+
+// Writes the super block to disk (padded to a full block)
+void writeSuperBlock(void) {
+    Byte superBlockData[B];
+    memset(superBlockData, 0, B);
+    memcpy(superBlockData, &superBlock, sizeof(superBlock));
+    write_blocks(0, 1, superBlockData);
+}
+
+// Grows the inode table by `INODES_PER_CHUNK` free inodes, taking the blocks for them from the data blocks
+int sfs_growInodeTable(void) {
+    if (superBlock.inodeCount + INODES_PER_CHUNK > MAX_INODES) {
+        fprintf(stderr, "Failed to grow inode table: the inode bitmap is full.\n");
+        return -1;
+    }
+
+    Inode *grown = (Inode *) realloc(inodeTable, (superBlock.inodeCount + INODES_PER_CHUNK) * sizeof(Inode));
+    if (grown == NULL) {
+        fprintf(stderr, "Failed to grow inode table: ran out of memory.\n");
+        return -1;
+    }
+    inodeTable = grown;
+
+    // Prefer a single run of blocks for the chunk, but any free blocks will do
+    int pointers[INODE_CHUNK_BLOCKS];
+    int start = sfs_allocateContiguousDataBlocks(INODE_CHUNK_BLOCKS);
+    for (int i = 0; i < INODE_CHUNK_BLOCKS; ++i) {
+        pointers[i] = start >= 0 ? start + i : sfs_allocateFreeDataBlock();
+        if (pointers[i] < 0) {
+            fprintf(stderr, "Failed to grow inode table: there are not enough free data blocks available.\n");
+            for (int j = 0; j < i; ++j) {
+                sfs_freeDataBlock(pointers[j]);
+            }
+            return -1;
+        }
+    }
+
+    int chunkBlock = superBlock.inodeTableExt.size / B;
+    if (setInodeBlockPointers(&superBlock.inodeTableExt, pointers, chunkBlock, INODE_CHUNK_BLOCKS) != 0) {
+        fprintf(stderr, "Failed to grow inode table: could not map the new blocks.\n");
+        for (int i = 0; i < INODE_CHUNK_BLOCKS; ++i) {
+            sfs_freeDataBlock(pointers[i]);
+        }
+        return -1;
+    }
+    superBlock.inodeTableExt.size += INODE_CHUNK_BLOCKS * B;
+
+    free(inodeTableExtMap);
+    inodeTableExtMapEntries = loadExtents(&superBlock.inodeTableExt, &inodeTableExtMap, 0);
+
+    // Init and write out the new (free) inodes
+    Inode *chunk = inodeTable + superBlock.inodeCount;
+    memset(chunk, 0, INODES_PER_CHUNK * sizeof(Inode));
+    for (int i = 0; i < INODES_PER_CHUNK; ++i) {
+        chunk[i].size = -1;
+    }
+    for (int i = 0; i < INODE_CHUNK_BLOCKS; ++i) {
+        write_blocks(pointers[i], 1, (Byte *) chunk + i * B);
+    }
+    superBlock.inodeCount += INODES_PER_CHUNK;
+
+    write_blocks(superBlock.sfsSize - superBlock.fbmSize, superBlock.fbmSize, fbm);
+    writeSuperBlock();
+    return 0;
+}
+
+// Allocates the first free inode as per the inode bitmap, growing the inode table if all inodes are in use
+int sfs_allocateInode(void) {
+    int inodeNum = -1;
+    for (int i = BYTE_OFFSET(nextFreeInodeHint); i < BYTE_OFFSET(superBlock.inodeCount); ++i) {
+        if ((Byte) ~ibm[i] != 0) { // Skip whole bytes of used inodes at a time
+            inodeNum = i * 8 + __builtin_ctz((unsigned char) ~ibm[i]);
+            break;
+        }
+    }
+
+    if (inodeNum < 0) {
+        if (sfs_growInodeTable() != 0)
+            return -1;
+        inodeNum = superBlock.inodeCount - INODES_PER_CHUNK;
+    }
+
+    setBit(ibm, inodeNum);
+    nextFreeInodeHint = inodeNum + 1;
+    write_blocks(superBlock.inodeBitmapBlock, 1, ibm);
+    return inodeNum;
+}
+
+// Releases an inode by clearing its bit in the inode bitmap
+void sfs_freeInode(int inodeNum) {
+    inodeTable[inodeNum].size = -1;
+    clearBit(ibm, inodeNum);
+    if (inodeNum < nextFreeInodeHint)
+        nextFreeInodeHint = inodeNum;
+    write_blocks(superBlock.inodeBitmapBlock, 1, ibm);
+}
+
+// Releases a file that no directory refers to anymore: its data blocks, extent tree nodes and inode. An open file is
+// only flagged, and released once its last descriptor is closed (its descriptors keep reading and writing it until then).
+void releaseFile(int inodeNum) {
+    if (openFiles[inodeNum] != NULL) {
+        openFiles[inodeNum]->unlinked = 1;
+        return;
+    }
+    freeInodeBlocks(&inodeTable[inodeNum]);
+    sfs_freeInode(inodeNum);
+    writeInode(inodeNum);
+    write_blocks(superBlock.sfsSize - superBlock.fbmSize, superBlock.fbmSize, fbm);
+}
+
+// Returns the inode of a directory (the root directory's inode is in the super block)
+Inode *dirInode(const Directory *dir) {
+    return dir->inodeNum == ROOT_DIR_INODE ? &superBlock.rootDirInode : &inodeTable[dir->inodeNum];
+}
+
+// Writes the inode of a directory back to disk
+void writeDirInode(const Directory *dir) {
+    if (dir->inodeNum == ROOT_DIR_INODE)
+        writeSuperBlock();
+    else
+        writeInode(dir->inodeNum);
+}
+
+// Loads the records of the directory with inode `inodeNum` from its data blocks (with one read per extent), and
+// builds its hash index and gap lists
+int loadDirectory(Directory *dir, int inodeNum) {
+    memset(dir, 0, sizeof(Directory));
+    dir->inodeNum = inodeNum;
+
+    Inode *inode = dirInode(dir);
+    Extent *extents;
+    int entries = loadExtents(inode, &extents, 0);
+    if (entries < 0)
+        return -1;
+
+    dir->blocks = inode->size / B;
+    dir->records = (Byte *) malloc(inode->size > 0 ? inode->size : 1);
+    if (dir->records == NULL) {
+        fprintf(stderr, "Failed to load directory: ran out of memory.\n");
+        free(extents);
+        return -1;
+    }
+    for (int i = 0; i < entries; ++i) {
+        read_blocks(extents[i].physicalStart, extents[i].length, dir->records + extents[i].logicalStart * B);
+    }
+    free(extents);
+
+    if (trackDirBlocks(dir, 0) != 0)
+        return -1;
+    return dirIndexBuild(&dir->index, dir->records, inode->size);
+}
+
+// Releases the memory held by a loaded directory
+void unloadDirectory(Directory *dir) {
+    free(dir->records);
+    free(dir->index.slots);
+    free(dir->index.filter);
+    free(dir->blockMap);
+    free(dir->blockGap);
+    free(dir->gapNext);
+    free(dir->gapPrev);
+    memset(dir, 0, sizeof(Directory));
+}
+
+// Gets the loaded subdirectory with inode `inodeNum`, loading it on first use (directories stay loaded until unmount)
+Directory *getDirectory(int inodeNum) {
+    if (dirCache[inodeNum] != NULL)
+        return dirCache[inodeNum];
+
+    Directory *dir = (Directory *) malloc(sizeof(Directory));
+    if (dir == NULL || loadDirectory(dir, inodeNum) != 0) {
+        fprintf(stderr, "Failed to load directory: could not load the records of inode %d.\n", inodeNum);
+        if (dir != NULL)
+            unloadDirectory(dir);
+        free(dir);
+        return NULL;
+    }
+    dirCache[inodeNum] = dir;
+    return dir;
+}
+
+// Writes directory block `block` back to disk
+void writeDirBlock(Directory *dir, int block) {
+    if (dir->blockMap == NULL) {
+        int entries = loadExtents(dirInode(dir), &dir->blockMap, 0);
+        if (entries < 0) {
+            dir->blockMap = NULL;
+            return;
+        }
+        dir->blockMapEntries = entries;
+    }
+
+    int pointer = 0;
+    mapExtents(dir->blockMap, dir->blockMapEntries, &pointer, block, 1);
+    write_blocks(pointer, 1, dir->records + block * B);
+}
+
+// Doubles the number of data blocks of a directory (at least 1 block is added), each new block holding a single unused
+// record
+int growDirectory(Directory *dir) {
+    Inode *inode = dirInode(dir);
+    int oldBlocks = dir->blocks;
+    int newBlocks = oldBlocks > 0 ? oldBlocks : 1;
+    if (sfs_countFreeDataBlocks() < newBlocks) {
+        fprintf(stderr, "Failed to grow directory: there are not enough free data blocks available.\n");
+        return -1;
+    }
+
+    Byte *records = (Byte *) realloc(dir->records, (oldBlocks + newBlocks) * B);
+    if (records == NULL) {
+        fprintf(stderr, "Failed to grow directory: ran out of memory.\n");
+        return -1;
+    }
+    dir->records = records;
+    memset(records + oldBlocks * B, 0, newBlocks * B);
+    for (int i = oldBlocks; i < oldBlocks + newBlocks; ++i) {
+        dirRecord(dir, i * B)->recordLength = B;
+    }
+
+    // Prefer a single run of blocks, but any free blocks will do
+    int scratchMark = scratchUsed;
+    int *pointers = (int *) scratchAlloc(newBlocks * sizeof(int));
+    if (pointers == NULL) {
+        fprintf(stderr, "Failed to grow directory: ran out of scratch memory.\n");
+        return -1;
+    }
+    int start = sfs_allocateContiguousDataBlocks(newBlocks);
+    for (int i = 0; i < newBlocks; ++i) {
+        pointers[i] = start >= 0 ? start + i : sfs_allocateFreeDataBlock();
+    }
+    if (setInodeBlockPointers(inode, pointers, oldBlocks, newBlocks) != 0) {
+        fprintf(stderr, "Failed to grow directory: could not map the new blocks.\n");
+        for (int i = 0; i < newBlocks; ++i) {
+            sfs_freeDataBlock(pointers[i]);
+        }
+        scratchUsed = scratchMark;
+        return -1;
+    }
+    for (int i = 0; i < newBlocks; ++i) {
+        write_blocks(pointers[i], 1, records + (oldBlocks + i) * B);
+    }
+    scratchUsed = scratchMark;
+
+    inode->size = (oldBlocks + newBlocks) * B;
+    dir->blocks = oldBlocks + newBlocks;
+    if (trackDirBlocks(dir, oldBlocks) != 0)
+        dir->blocks = oldBlocks; // The new blocks stay unused, until the directory is loaded again
+    writeDirInode(dir);
+    write_blocks(superBlock.sfsSize - superBlock.fbmSize, superBlock.fbmSize, fbm);
+    invalidateBlockMaps(dir->inodeNum);
+    return 0;
+}
+
+// Adds an entry named `name` for inode `inodeNum` to a directory, growing the directory if no block has room for it.
+// The record takes the free gap at the end of a record (splitting it), or an unused record.
+int addDirEntry(Directory *dir, const char *name, int inodeNum) {
+    int nameLength = strlen(name);
+    int size = DIR_RECORD_SIZE(nameLength);
+    int block = findDirBlock(dir, size);
+    if (block < 0) { // No block has room for the record
+        if (growDirectory(dir) != 0)
+            return -1;
+        block = findDirBlock(dir, size);
+    }
+
+    int offset = block * B;
+    while (dirRecordGap(dirRecord(dir, offset)) < size)
+        offset += dirRecord(dir, offset)->recordLength;
+
+    unsigned int hash = hashFilename(name);
+    DirRecord *record = dirRecord(dir, offset);
+    int pos = record->nameLength == 0 ? offset : offset + DIR_RECORD_SIZE(record->nameLength);
+    if (dirIndexInsert(&dir->index, hash, pos) != 0)
+        return -1;
+
+    if (pos != offset) { // Split the gap off the end of the record
+        DirRecord *newRecord = dirRecord(dir, pos);
+        newRecord->recordLength = record->recordLength - (pos - offset);
+        record->recordLength = pos - offset;
+        record = newRecord;
+    }
+    record->nameLength = (unsigned char)nameLength;
+    record->inodeNum = inodeNum;
+    record->hash = hash;
+    memcpy(record->name, name, nameLength);
+
+    updateDirBlockGap(dir, block);
+    writeDirBlock(dir, block);
+    return pos;
+}
+
+// Removes the entry at `pos` from a directory, merging its record into the one before it (the first record of a block
+// is just marked unused instead)
+void removeDirEntry(Directory *dir, int pos) {
+    DirRecord *record = dirRecord(dir, pos);
+    char name[MAXFILENAME + 1];
+    memcpy(name, record->name, record->nameLength);
+    name[record->nameLength] = '\0';
+    dirIndexRemove(&dir->index, dir->records, name);
+
+    int block = pos / B;
+    if (pos == block * B) {
+        record->nameLength = 0;
+    } else {
+        int previous = block * B;
+        while (previous + dirRecord(dir, previous)->recordLength < pos)
+            previous += dirRecord(dir, previous)->recordLength;
+        dirRecord(dir, previous)->recordLength += record->recordLength;
+    }
+
+    updateDirBlockGap(dir, block);
+    writeDirBlock(dir, block);
+}
+
+// Splits `path` into the directory holding its last component (resolving every directory on the way), and the last
+// component itself, which is copied into `name` (empty if `path` is the root directory). Path components are
+// separated by '/', and empty components are ignored, so paths may be absolute or relative to the root directory.
+Directory *resolveParent(const char *path, char name[MAXFILENAME + 1]) {
+    // The last component starts after the last '/' (ignoring trailing ones)
+    int end = strlen(path);
+    while (end > 0 && path[end - 1] == '/')
+        --end;
+    int nameStart = end;
+    while (nameStart > 0 && path[nameStart - 1] != '/')
+        --nameStart;
+
+    if (end - nameStart > MAXFILENAME) {
+        fprintf(stderr, "Failed to resolve path: File name is too long.\n");
+        return NULL;
+    }
+    memcpy(name, path + nameStart, end - nameStart);
+    name[end - nameStart] = '\0';
+
+    // Resolving the same parent as last time (e.g. for each file of a directory listing) hits the cache
+    if (cachedParent != NULL && nameStart < MAXPATHNAME && strncmp(cachedParentPath, path, nameStart) == 0
+        && cachedParentPath[nameStart] == '\0')
+        return cachedParent;
+
+    Directory *dir = &rootDir;
+    char component[MAXFILENAME + 1];
+    for (int i = 0; i < nameStart;) {
+        if (path[i] == '/') {
+            ++i;
+            continue;
+        }
+        int length = 0;
+        while (i + length < nameStart && path[i + length] != '/')
+            ++length;
+        if (length > MAXFILENAME) {
+            fprintf(stderr, "Failed to resolve path: Directory name is too long.\n");
+            return NULL;
+        }
+        memcpy(component, path + i, length);
+        component[length] = '\0';
+        i += length;
+
+        // A directory on the way that doesn't exist is a lookup miss, which is left for the caller to report
+        int pos = dirIndexLookup(&dir->index, dir->records, component);
+        if (pos < 0 || !(inodeTable[dirRecord(dir, pos)->inodeNum].header.flags & INODE_DIRECTORY))
+            return NULL;
+        int inodeNum = dirRecord(dir, pos)->inodeNum;
+        if ((dir = getDirectory(inodeNum)) == NULL)
+            return NULL;
+    }
+
+    if (nameStart < MAXPATHNAME) {
+        memcpy(cachedParentPath, path, nameStart);
+        cachedParentPath[nameStart] = '\0';
+        cachedParent = dir;
+    }
+    return dir;
+}
+
+// Resolves `path` to a directory, or returns NULL if it isn't one
+Directory *resolveDirectory(const char *path) {
+    char name[MAXFILENAME + 1];
+    Directory *parent = resolveParent(path, name);
+    if (parent == NULL)
+        return NULL;
+    if (name[0] == '\0') // The root directory
+        return parent;
+
+    int pos = dirIndexLookup(&parent->index, parent->records, name);
+    if (pos < 0 || !(inodeTable[dirRecord(parent, pos)->inodeNum].header.flags & INODE_DIRECTORY)) {
+        fprintf(stderr, "Failed to resolve path: '%s' is not a directory.\n", path);
+        return NULL;
+    }
+    return getDirectory(dirRecord(parent, pos)->inodeNum);
+}
+
+// Returns 1 if one of the directories on the way to the last component of `path` is inode `inodeNum`, i.e. if `path`
+// is inside that directory
+int pathGoesThrough(const char *path, int inodeNum) {
+    int end = strlen(path);
+    while (end > 0 && path[end - 1] == '/')
+        --end;
+    int nameStart = end;
+    while (nameStart > 0 && path[nameStart - 1] != '/')
+        --nameStart;
+
+    Directory *dir = &rootDir;
+    char component[MAXFILENAME + 1];
+    for (int i = 0; i < nameStart;) {
+        if (path[i] == '/') {
+            ++i;
+            continue;
+        }
+        int length = 0;
+        while (i + length < nameStart && path[i + length] != '/')
+            ++length;
+        if (length > MAXFILENAME)
+            return 0;
+        memcpy(component, path + i, length);
+        component[length] = '\0';
+        i += length;
+
+        int pos = dirIndexLookup(&dir->index, dir->records, component);
+        if (pos < 0)
+            return 0;
+        int childInode = dirRecord(dir, pos)->inodeNum;
+        if (childInode == inodeNum)
+            return 1;
+        if ((dir = getDirectory(childInode)) == NULL)
+            return 0;
+    }
+    return 0;
+}
+
+// -- SFS API FUNCTIONS --
+
+void mksfs(int fresh) {
+    // Write the mappings and the appends still buffered by open files back, to the disk they belong to
+    while (mappings != NULL)
+        sfs_munmap(mappings->data);
+    for (int i = 0; i < fdtSize; ++i) {
+        if (FDT[i].inodeNum >= 0)
+            flushWriteBuffer(i, FDT[i].writeBufferLength);
+    }
+
+    // Files removed while open are released from that disk too, since all the descriptors are dropped below
+    for (int i = 0; i < MAX_INODES; ++i) {
+        if (openFiles[i] != NULL && openFiles[i]->unlinked) {
+            free(openFiles[i]->blockMap);
+            free(openFiles[i]->readAhead);
+            free(openFiles[i]);
+            openFiles[i] = NULL;
+            releaseFile(i);
+        }
+    }
+
+    // Drop any cached extent tree nodes, they may belong to a previously loaded disk
+    memset(nodeCache, 0, sizeof(nodeCache));
+    nodeCacheClock = 0;
+
+    if (fresh) { // New file system
+        init_fresh_disk(DISKNAME, B, Q);
+
+        // Init super block
+        memset(&superBlock, 0, sizeof(superBlock));
+        superBlock.blockSize = B;
+        superBlock.sfsSize = Q;
+        superBlock.inodeTableSize = M;
+        superBlock.dataBlocksCount = N;
+        superBlock.fbmSize = L;
+        superBlock.rootDirInode.header.flags = INODE_DIRECTORY; // Empty, the root directory grows as files are added
+        superBlock.inodeCount = BASE_INODES;
+
+        // Init inode table (only the inode table region to begin with), root directory and bitmaps
+        Inode *table = (Inode *) realloc(inodeTable, BASE_INODES * sizeof(Inode));
+        if (table == NULL) {
+            fprintf(stderr, "Failed to make new sfs: ran out of memory for the inode table.\n");
+            return;
+        }
+        inodeTable = table;
+        memset(inodeTable, 0, BASE_INODES * sizeof(Inode));
+        memset(fbm, 0, sizeof(fbm));
+        memset(ibm, 0, sizeof(ibm));
+        for (int i = 0; i < BASE_INODES; ++i) {
+            inodeTable[i].size = -1;
+        }
+
+        // Write inodeTable to disk
+        write_blocks(1, superBlock.inodeTableSize, inodeTable);
+
+        // Allocate a block for the inode bitmap (the inode table doesn't extend into the data blocks yet)
+        superBlock.inodeBitmapBlock = sfs_allocateFreeDataBlock();
+        write_blocks(superBlock.inodeBitmapBlock, 1, ibm);
+        write_blocks(superBlock.sfsSize - superBlock.fbmSize, superBlock.fbmSize, fbm);
+        
+        // Write the super block to disk too
+        writeSuperBlock();
+    } else { // Existing file system
+        init_disk(DISKNAME, B, Q);
+
+        // Load super block (only kept once there is room for the inode table it describes)
+        Byte superBlockData[B];
+        SuperBlock loaded;
+        read_blocks(0, 1, superBlockData);
+        memcpy(&loaded, superBlockData, sizeof(loaded));
+
+        // Load inode table, from the inode table region and then from the data blocks it has grown into (if any)
+        Inode *table = (Inode *) realloc(inodeTable, loaded.inodeCount * sizeof(Inode));
+        if (table == NULL) {
+            fprintf(stderr, "Failed to load sfs: ran out of memory for the inode table.\n");
+            return;
+        }
+        inodeTable = table;
+        superBlock = loaded;
+        read_blocks(1, superBlock.inodeTableSize, inodeTable);
+
+        free(inodeTableExtMap);
+        inodeTableExtMapEntries = loadExtents(&superBlock.inodeTableExt, &inodeTableExtMap, 0);
+        for (int i = 0; i < inodeTableExtMapEntries; ++i) {
+            Extent e = inodeTableExtMap[i];
+            read_blocks(e.physicalStart, e.length, (Byte *) (inodeTable + BASE_INODES) + e.logicalStart * B);
+        }
+
+        // Load inode bitmap
+        read_blocks(superBlock.inodeBitmapBlock, 1, ibm);
+
+        // Load free bitmap
+        read_blocks(superBlock.sfsSize - superBlock.fbmSize, superBlock.fbmSize, fbm);
+    }
+
+    // Load the root directory (and its hash index), subdirectories are only loaded once a path goes through them
+    unloadDirectory(&rootDir);
+    for (int i = 0; i < MAX_INODES; ++i) {
+        if (dirCache[i] != NULL) {
+            unloadDirectory(dirCache[i]);
+            free(dirCache[i]);
+            dirCache[i] = NULL;
+        }
+    }
+    cachedParent = NULL;
+    loadDirectory(&rootDir, ROOT_DIR_INODE);
+
+    // Init the scratch memory and the FDT (no file is open)
+    if (initScratch() != 0)
+        fprintf(stderr, "Failed to allocate scratch memory: ran out of memory.\n");
+    for (int i = 0; i < fdtSize; ++i)
+        free(FDT[i].writeBuffer);
+    free(FDT);
+    FDT = NULL;
+    fdtSize = 0;
+    fdtFreeHead = -1;
+    growFDT();
+    for (int i = 0; i < MAX_INODES; ++i) {
+        if (openFiles[i] != NULL) {
+            free(openFiles[i]->blockMap);
+            free(openFiles[i]->readAhead);
+            free(openFiles[i]);
+            openFiles[i] = NULL;
+        }
+    }
+    
+    // Init `currentFileIndex`, `defragCursor` and `nextFreeInodeHint`
+    currentFileIndex = 0;
+    defragCursor = 0;
+    nextFreeInodeHint = 0;
+}
+
+int sfs_getnextfilename(char *filename) {
+    // Look up the next used record (= next file) of the root directory, from the one after the last file returned
+    int end = rootDir.blocks * B;
+    for (int offset = nextDirRecord(&rootDir, currentFileIndex); offset < end;
+         offset += dirRecord(&rootDir, offset)->recordLength) {
+        DirRecord *record = dirRecord(&rootDir, offset);
+        if (record->nameLength != 0) {
+            // `filename` has room for `MAXFILENAME + 1` bytes, the longest name and its terminator
+            memcpy(filename, record->name, record->nameLength);
+            filename[record->nameLength] = '\0';
+            currentFileIndex = offset + record->recordLength;
+            return 1;
+        }
+    }
+
+    // Reached the end of the directory, reset to the start of it
+    currentFileIndex = 0;
+    return 0;
+}
+
+int sfs_getfilesize(const char *filename) {
+    // Look up the file in its directory - a file that doesn't exist isn't an error here (e.g. FUSE checks whether files
+    // exist with it), so it is reported silently
+    char name[MAXFILENAME + 1];
+    Directory *dir = resolveParent(filename, name);
+    if (dir == NULL)
+        return -1;
+    if (name[0] == '\0') // The root directory
+        return superBlock.rootDirInode.size;
+
+    int dir_pos = dirIndexLookup(&dir->index, dir->records, name);
+    if (dir_pos < 0)
+        return -1;
+    
+    // File exists, return file size (including the appends that are still buffered)
+    int inodeNum = dirRecord(dir, dir_pos)->inodeNum;
+    flushInodeWrites(inodeNum);
+    return inodeTable[inodeNum].size;
+}
+
+int sfs_isdir(const char *path) {
+    char name[MAXFILENAME + 1];
+    Directory *dir = resolveParent(path, name);
+    if (dir == NULL)
+        return -1;
+    if (name[0] == '\0') // The root directory
+        return 1;
+
+    int dir_pos = dirIndexLookup(&dir->index, dir->records, name);
+    if (dir_pos < 0)
+        return -1;
+    return (inodeTable[dirRecord(dir, dir_pos)->inodeNum].header.flags & INODE_DIRECTORY) != 0;
+}
+
+int sfs_fopen(char *filename) {
+    // Look up the file in its directory
+    char name[MAXFILENAME + 1];
+    Directory *dir = resolveParent(filename, name);
+    if (dir == NULL) {
+        fprintf(stderr, "Failed to open file: the directory of '%s' could not be resolved.\n", filename);
+        return -1;
+    }
+    if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        fprintf(stderr, "Failed to open file: '%s' is not a valid file name.\n", filename);
+        return -1;
+    }
+    int dir_pos = dirIndexLookup(&dir->index, dir->records, name);
+
+    // Get next free FDT slot index - every open gets a descriptor of its own, so we know in advance if there is space
+    int fdt_pos = sfs_getNextFreeFDTPos();
+    if (fdt_pos < 0) { // FDT is full
+        fprintf(stderr, "Failed to open file: The FDT is full.\n");
+        return -1;
+    }
+
+    int inodeNum;
+    if (dir_pos < 0) { // File does not exist, need to 'create' a new directory entry
+        inodeNum = sfs_allocateInode();
+        if (inodeNum < 0) { // All inodes are in use, and the inode table can't grow any further
+            fprintf(stderr, "Failed to create file: There are no free inodes.\n");
+            return -1;
+        }
+
+        // New files are empty, so they start out with (no) inline data instead of extents
+        Inode *inode = &inodeTable[inodeNum];
+        memset(inode, 0, sizeof(Inode));
+        inode->header.flags = INODE_INLINE_DATA;
+
+        // Add the entry to the directory (it is written to disk, growing the directory if it is full)
+        if (addDirEntry(dir, name, inodeNum) < 0) {
+            fprintf(stderr, "Failed to create file: Could not add the file to the directory.\n");
+            sfs_freeInode(inodeNum);
+            return -1;
+        }
+
+        // Write new inode to disk
+        writeInode(inodeNum);
+    } else { // File exists
+        inodeNum = dirRecord(dir, dir_pos)->inodeNum;
+        if (inodeTable[inodeNum].header.flags & INODE_DIRECTORY) {
+            fprintf(stderr, "Failed to open file: '%s' is a directory.\n", filename);
+            return -1;
+        }
+    }
+
+    // Appends other descriptors still have buffered are written first, so that the new head starts past them
+    if (flushInodeWrites(inodeNum) != 0) {
+        fprintf(stderr, "Failed to open file: the buffered writes could not be written.\n");
+        return -1;
+    }
+
+    // Share the open file (and its cached block map) if the file is already open in other descriptors
+    OpenFile *openFile = openFiles[inodeNum];
+    if (openFile == NULL) {
+        openFile = (OpenFile *) calloc(1, sizeof(OpenFile));
+        if (openFile == NULL) {
+            fprintf(stderr, "Failed to open file: ran out of memory while trying to open the file.\n");
+            return -1;
+        }
+        openFile->inodeNum = inodeNum;
+        openFile->bufferedFd = -1;
+        openFiles[inodeNum] = openFile;
+    }
+    ++openFile->refCount;
+
+    // Open the file in a new descriptor, in append mode (read/write head at EOF)
+    fdtFreeHead = FDT[fdt_pos].nextFree;
+    FDT[fdt_pos].inodeNum = inodeNum;
+    FDT[fdt_pos].openFile = openFile;
+    FDT[fdt_pos].rwHeadPos = inodeTable[inodeNum].size;
+    FDT[fdt_pos].lastReadEnd = -1;
+    FDT[fdt_pos].sequentialReads = 0;
+    FDT[fdt_pos].writeBufferLength = 0;
+    FDT[fdt_pos].writeBuffering = 1;
+    return fdt_pos;
+}
+
+int sfs_fclose(int fd) {
+    if (fd < 0 || fd >= fdtSize) {
+        fprintf(stderr, "Failed to close file: the file descriptor is outside the bounds of the FDT.\n");
+        return -1;
+    }
+
+    if (FDT[fd].inodeNum < 0) {
+        fprintf(stderr, "Failed to close file: the file descriptor has no file associated.\n");
+        return -1;
+    }
+
+    // FDT[fd] points to valid open file, write its mappings and buffered appends back and close it (even if they can't
+    // be written)
+    int res = 0;
+    for (Mapping *mapping = mappings, *next; mapping != NULL; mapping = next) {
+        next = mapping->next;
+        if (mapping->fd == fd && sfs_munmap(mapping->data) != 0)
+            res = -1;
+    }
+    if (flushWriteBuffer(fd, FDT[fd].writeBufferLength) != 0) {
+        fprintf(stderr, "Failed to close file: the buffered writes could not be written.\n");
+        discardInodeWrites(FDT[fd].inodeNum);
+        res = -1;
+    }
+
+    // The open file itself is released with its last descriptor, along with the file if it was removed meanwhile
+    OpenFile *openFile = FDT[fd].openFile;
+    if (--openFile->refCount == 0) {
+        openFiles[openFile->inodeNum] = NULL;
+        if (openFile->unlinked)
+            releaseFile(openFile->inodeNum);
+        free(openFile->blockMap);
+        free(openFile->readAhead);
+        free(openFile);
+    }
+    FDT[fd].openFile = NULL;
+    FDT[fd].inodeNum = -1;
+    FDT[fd].nextFree = fdtFreeHead;
+    fdtFreeHead = fd;
+    return res;
+}
+
+int sfs_pwritev(int fd, const SfsIovec *iov, int iovcnt, int offset) {
+    int length = iovecLength(iov, iovcnt);
+    if (length < 0) {
+        fprintf(stderr, "Failed to write to file: the buffer lengths are not valid.\n");
+        return -1;
+    }
+    if (length < 1) {
+        return 0;
+    }
+    
+    if (fd < 0 || fd >= fdtSize) {
+        fprintf(stderr, "Failed to write to file: the file descriptor is outside the bounds of the FDT.\n");
+        return -1;
+    }
+
+    if (FDT[fd].inodeNum < 0) {
+        fprintf(stderr, "Failed to write to file: the file descriptor has no file associated.\n");
+        return -1;
+    }
+    
+    if (offset < 0 || offset > INT_MAX - length) { // The end of the write must fit in a file size
+        fprintf(stderr, "Failed to write to file: the offset to write at is not valid for this file.\n");
+        return -1;
+    }
+    if (flushInodeWrites(FDT[fd].inodeNum) != 0) { // Buffered appends go first, they were written before
+        fprintf(stderr, "Failed to write to file: the buffered writes could not be written.\n");
+        return -1;
+    }
+    dropReadAhead(FDT[fd].inodeNum); // The blocks prefetched may be overwritten
+
+    // `FDT[fd]` points to a valid open file (the offset may be past the end of the file, in which case the gap is left
+    // as a hole)
+    Inode inode = inodeTable[FDT[fd].inodeNum];
+    
+    // Get start and end bytes/blocks
+    int startPos = offset;
+    int endPos = startPos + length;
+
+    if (inode.header.flags & INODE_INLINE_DATA && endPos <= INLINE_DATA_SIZE) {
+        // The file still fits in the inode, so only the inode needs to be written (no data blocks, no bitmap). Inline
+        // data past the end of the file is always zero, so a gap before `startPos` reads back as zeros.
+        copyIovec(iov, iovcnt, 0, INLINE_DATA(&inode) + startPos, length, 0);
+        if (endPos > inode.size)
+            inode.size = endPos;
+
+        inodeTable[FDT[fd].inodeNum] = inode;
+        writeInode(FDT[fd].inodeNum);
+        updateMappings(FDT[fd].inodeNum, iov, iovcnt, offset, length);
+        return length;
+    }
+
+    int startBlock = startPos / B;
+    int endBlock = (endPos - 1) / B; // Last block written to
+    int blocksToWrite = endBlock - startBlock + 1;
+    if (blocksToWrite > superBlock.dataBlocksCount) { // Can't be mapped without more blocks than the disk has
+        fprintf(stderr, "Failed to write to file: there are not enough free data blocks available.\n");
+        return -1;
+    }
+    
+    int startBlockStartPos = startPos % B;
+
+    // Scratch memory for the block pointers and the runs they make up, the first and last blocks (if they are partially
+    // written), the former inline data and a block spanning several buffers - released before returning
+    int scratchMark = scratchUsed;
+    int *blocksToWritePointers = (int *) scratchAlloc(blocksToWrite * sizeof(int));
+    int *newPointers = (int *) scratchAlloc(blocksToWrite * sizeof(int));
+    Extent *runs = (Extent *) scratchAlloc((blocksToWrite + 1) * sizeof(Extent));
+    Byte *partialBlocks = (Byte *) scratchAlloc(2 * B);
+    Byte *inlineBlock = (Byte *) scratchAlloc(B);
+    Byte *gatherBlock = (Byte *) scratchAlloc(B);
+    if (blocksToWritePointers == NULL || newPointers == NULL || runs == NULL || gatherBlock == NULL) {
+        fprintf(stderr, "Failed to write to file: ran out of scratch memory.\n");
+        scratchUsed = scratchMark;
+        return -1;
+    }
+
+    // The file is outgrowing its inline data, move the data to a data block of its own (block 0 of the file)
+    int isInline = inode.header.flags & INODE_INLINE_DATA;
+    if (isInline) {
+        memset(inlineBlock, 0, B);
+        memcpy(inlineBlock, INLINE_DATA(&inode), inode.size);
+        memset(&inode.header, 0, sizeof(ExtentHeader) + sizeof(inode.extents));
+    }
+    
+    // Gather pointers to the blocks to write, existing blocks are mapped and the others (holes, or past the end of the
+    // file) are left as 0 - an inline file has no mapped blocks
+    if (getFileBlockPointers(fd, blocksToWritePointers, startBlock, blocksToWrite) < 0) {
+        scratchUsed = scratchMark;
+        return -1;
+    }
+    // The former inline data (if there is any, an empty file leaves block 0 a hole) needs a block outside of the written
+    // range
+    int relocateInline = isInline && startBlock > 0 && inode.size > 0;
+    int blocksToAdd = relocateInline;
+    for (int i = 0; i < blocksToWrite; ++i) {
+        if (blocksToWritePointers[i] == 0)
+            ++blocksToAdd;
+    }
+    
+    if (sfs_countFreeDataBlocks() < blocksToAdd) {
+        fprintf(stderr, "Failed to write to file: there are not enough free data blocks available.\n");
+        scratchUsed = scratchMark;
+        return -1;
+    }
+
+    // Merge the partially written first and last blocks with their existing data, in scratch blocks (whole blocks are
+    // written straight from the buffers). Blocks that aren't mapped yet are zero-filled, so that the bytes past the end of the
+    // file are always zero.
+    int lastPartial = endPos % B != 0 ? blocksToWrite - 1 : -1;
+    int firstPartial = startBlockStartPos != 0 ? 0 : lastPartial == 0 ? 0 : -1;
+    for (int i = 0; i < blocksToWrite; i += (blocksToWrite > 1 ? blocksToWrite - 1 : 1)) {
+        if (i != firstPartial && i != lastPartial)
+            continue;
+        Byte *blockData = partialBlocks + (i == 0 ? 0 : B);
+        if (blocksToWritePointers[i] != 0)
+            read_blocks(blocksToWritePointers[i], 1, blockData);
+        else if (isInline && startBlock + i == 0) // Block 0 is only a hole because its data is still inline
+            memcpy(blockData, inlineBlock, B);
+        else
+            memset(blockData, 0, B);
+
+        int blockStartPos = (startBlock + i) * B;
+        int from = blockStartPos > startPos ? blockStartPos : startPos; // Part of the block that is written
+        int to = blockStartPos + B < endPos ? blockStartPos + B : endPos;
+        copyIovec(iov, iovcnt, from - startPos, blockData + (from - blockStartPos), to - from, 0);
+    }
+
+    if (blocksToAdd > 0) {
+        // Allocate the new blocks, keeping the pointers of the blocks already mapped so the whole range can be mapped.
+        // Each run of unmapped blocks is allocated contiguously if there is a free run long enough for it, so that it is
+        // written (and later read) with a single I/O.
+        int inlineBlockPointer = 0;
+        int allocated = 1;
+        memset(newPointers, 0, blocksToWrite * sizeof(int));
+        for (int i = 0; i < blocksToWrite && allocated;) {
+            if (blocksToWritePointers[i] != 0) {
+                newPointers[i] = blocksToWritePointers[i];
+                ++i;
+                continue;
+            }
+            int run = 1;
+            while (i + run < blocksToWrite && blocksToWritePointers[i + run] == 0)
+                ++run;
+            int runStart = run > 1 ? sfs_allocateContiguousDataBlocks(run) : -1;
+            for (int j = 0; j < run && allocated; ++j) {
+                newPointers[i + j] = runStart > 0 ? runStart + j : sfs_allocateFreeDataBlock();
+                allocated = newPointers[i + j] >= 0;
+                if (!allocated)
+                    newPointers[i + j] = 0;
+            }
+            i += run;
+        }
+        if (allocated && relocateInline) {
+            inlineBlockPointer = sfs_allocateFreeDataBlock();
+            allocated = inlineBlockPointer >= 0;
+        }
+
+        // Map the new blocks into the file, along with the block of the former inline data in the same extent tree update
+        // so that nothing is written if it fails (this is the only step that can run out of space for metadata)
+        int runCount = 0;
+        if (inlineBlockPointer > 0) {
+            Extent inlineRun = { 0, inlineBlockPointer, 1 };
+            runs[runCount++] = inlineRun;
+        }
+        runCount += pointersToRuns(newPointers, startBlock, blocksToWrite, runs + runCount);
+        int firstMapped = inlineBlockPointer > 0 ? 0 : startBlock;
+        if (!allocated || updateExtentTree(&inode, firstMapped, startBlock + blocksToWrite, runs, runCount) != 0) {
+            fprintf(stderr, "Failed to write to file: could not allocate and map the new data blocks.\n");
+            for (int i = 0; i < blocksToWrite; ++i) {
+                if (blocksToWritePointers[i] == 0 && newPointers[i] > 0)
+                    sfs_freeDataBlock(newPointers[i]);
+            }
+            if (inlineBlockPointer > 0)
+                sfs_freeDataBlock(inlineBlockPointer);
+            scratchUsed = scratchMark;
+            return -1;
+        }
+
+        memcpy(blocksToWritePointers, newPointers, blocksToWrite * sizeof(int));
+        if (inlineBlockPointer > 0)
+            write_blocks(inlineBlockPointer, 1, inlineBlock);
+
+        // Keep the cached block map up to date, rather than decoding the whole extent tree again on the next access
+        remapBlockMap(FDT[fd].openFile, firstMapped, startBlock + blocksToWrite, runs, runCount);
+    }
+
+    // Write the blocks to disk, a run of whole blocks that are physically consecutive (and in the same buffer) in a
+    // single write
+    for (int i = 0; i < blocksToWrite;) {
+        if (i == firstPartial || i == lastPartial) {
+            write_blocks(blocksToWritePointers[i], 1, partialBlocks + (i == 0 ? 0 : B));
+            ++i;
+            continue;
+        }
+        int contiguous;
+        char *src = iovecAt(iov, iovcnt, (startBlock + i) * B - startPos, &contiguous);
+        if (contiguous < B) { // The block spans several buffers, gather it first
+            copyIovec(iov, iovcnt, (startBlock + i) * B - startPos, gatherBlock, B, 0);
+            write_blocks(blocksToWritePointers[i], 1, gatherBlock);
+            ++i;
+            continue;
+        }
+        int run = 1;
+        while (i + run < blocksToWrite && i + run != lastPartial && (run + 1) * B <= contiguous
+               && blocksToWritePointers[i + run] == blocksToWritePointers[i] + run)
+            ++run;
+        write_blocks(blocksToWritePointers[i], run, src);
+        i += run;
+    }
+    scratchUsed = scratchMark;
+
+    // Update the inode size (only if the write caused the file to increase in size)
+    if (endPos > inode.size)
+        inode.size = endPos;
+    
+    // Update the inode in `inodeTable` and write the updated inode back to disk
+    inodeTable[FDT[fd].inodeNum] = inode;
+    writeInode(FDT[fd].inodeNum);
+    
+    // Write the updated free bitmap back to disk (only if blocks were allocated)
+    if (blocksToAdd > 0)
+        write_blocks(superBlock.sfsSize - superBlock.fbmSize, superBlock.fbmSize, fbm);
+    updateMappings(FDT[fd].inodeNum, iov, iovcnt, offset, length);
+    
+    return length;
+}
+
+int sfs_pwrite(int fd, const char *buf, int length, int offset) {
+    if (length < 1) {
+        return 0;
+    }
+    SfsIovec iov = { (void *) buf, length };
+    return sfs_pwritev(fd, &iov, 1, offset);
+}
+
+int sfs_writev(int fd, const SfsIovec *iov, int iovcnt) {
+    // Write at the read/write head (after the appends buffered by the descriptor), and move it past the data written
+    int written = sfs_pwritev(fd, iov, iovcnt, fd >= 0 && fd < fdtSize ? FDT[fd].rwHeadPos : 0);
+    if (written > 0)
+        FDT[fd].rwHeadPos += written;
+    return written;
+}
+
+int sfs_fwrite(int fd, const char *buf, int length) {
+    // Small appends are gathered in the descriptor's write buffer
+    if (fd >= 0 && fd < fdtSize && FDT[fd].inodeNum >= 0 && length > 0) {
+        int buffered = bufferWrite(fd, buf, length);
+        if (buffered < 0) {
+            fprintf(stderr, "Failed to write to file: the buffered writes could not be written.\n");
+            return -1;
+        }
+        if (buffered > 0) {
+            FDT[fd].rwHeadPos += buffered;
+            return buffered;
+        }
+    }
+
+    // Write at the read/write head, and move it past the data written
+    int written = sfs_pwrite(fd, buf, length, fd >= 0 && fd < fdtSize ? FDT[fd].rwHeadPos : 0);
+    if (written > 0)
+        FDT[fd].rwHeadPos += written;
+    return written;
+}
+
+int sfs_preadv(int fd, const SfsIovec *iov, int iovcnt, int offset) {
+    int length = iovecLength(iov, iovcnt);
+    if (length < 0) {
+        fprintf(stderr, "Failed to read file: the buffer lengths are not valid.\n");
+        return -1;
+    }
+
+    if (fd < 0 || fd >= fdtSize) {
+        fprintf(stderr, "Failed to read file: the file descriptor is outside the bounds of the FDT.\n");
+        return -1;
+    }
+
+    if (FDT[fd].inodeNum < 0) {
+        fprintf(stderr, "Failed to read file: the file descriptor has no file associated.\n");
+        return -1;
+    }
+    
+    if (offset < 0 || offset > INT_MAX - length) { // The end of the read must fit in a file size
+        fprintf(stderr, "Failed to read file: the offset to read from is not valid for this file.\n");
+        return -1;
+    }
+    if (flushInodeWrites(FDT[fd].inodeNum) != 0) { // So that the appends still buffered are read back
+        fprintf(stderr, "Failed to read file: the buffered writes could not be written.\n");
+        return -1;
+    }
+
+    // FDT[fd] points to valid open file
+    Inode inode = inodeTable[FDT[fd].inodeNum];
+    
+    // Reduce length of read if EOF is closer than offset + length
+    if (offset + length > inode.size) {
+        length = inode.size - offset;
+    }
+    if (length <= 0) {
+        return 0;
+    }
+
+    if (inode.header.flags & INODE_INLINE_DATA) { // The data is in the inode, no need to read any blocks
+        copyIovec(iov, iovcnt, 0, INLINE_DATA(&inode) + offset, length, 1);
+        return length;
+    }
+    
+    // Get start and end blocks
+    int startBlock = offset / B;
+    int endBlock = (offset + length - 1) / B; // Last block read from
+
+    // Scratch memory for the block pointers (a sparse file can span more blocks than the disk has, so the range is
+    // mapped in chunks of at most that many blocks) and the partially read blocks - released before returning
+    int scratchMark = scratchUsed;
+    int maxChunkBlocks = superBlock.dataBlocksCount;
+    int *existingBlocksPointers = (int *) scratchAlloc(maxChunkBlocks * sizeof(int));
+    Byte *bounceBlock = (Byte *) scratchAlloc(B);
+    if (bounceBlock == NULL) {
+        fprintf(stderr, "Failed to read file: ran out of scratch memory.\n");
+        scratchUsed = scratchMark;
+        return -1;
+    }
+
+    // Read whole blocks straight into the buffers (a run of physically consecutive blocks in a single read), only the
+    // partially read first and last blocks, and blocks that span several buffers, go through a bounce buffer
+    int endPos = offset + length;
+    for (int chunkStart = startBlock; chunkStart <= endBlock; chunkStart += maxChunkBlocks) {
+        int chunkBlocks = endBlock - chunkStart + 1 < maxChunkBlocks ? endBlock - chunkStart + 1 : maxChunkBlocks;
+        if (getFileBlockPointers(fd, existingBlocksPointers, chunkStart, chunkBlocks) < 0) {
+            scratchUsed = scratchMark;
+            return -1;
+        }
+
+        for (int i = 0; i < chunkBlocks;) {
+            int blockStartPos = (chunkStart + i) * B;
+            int from = blockStartPos > offset ? blockStartPos : offset; // Part of the block that is read
+            int to = blockStartPos + B < endPos ? blockStartPos + B : endPos;
+            int contiguous;
+            char *dest = iovecAt(iov, iovcnt, from - offset, &contiguous);
+
+            Byte *prefetched = readAheadBlock(FDT[fd].openFile, chunkStart + i);
+            if (prefetched != NULL) { // Read ahead by an earlier sequential read
+                copyIovec(iov, iovcnt, from - offset, prefetched + (from - blockStartPos), to - from, 1);
+                ++i;
+                continue;
+            }
+
+            if (to - from < B || contiguous < B) { // Partial block, or a block spanning several buffers
+                if (existingBlocksPointers[i] == 0) { // A hole, which reads back as zeros
+                    copyIovec(iov, iovcnt, from - offset, NULL, to - from, 1);
+                } else {
+                    read_blocks(existingBlocksPointers[i], 1, bounceBlock);
+                    copyIovec(iov, iovcnt, from - offset, bounceBlock + (from - blockStartPos), to - from, 1);
+                }
+                ++i;
+                continue;
+            }
+
+            int run = 1;
+            while (i + run < chunkBlocks && blockStartPos + (run + 1) * B <= endPos && (run + 1) * B <= contiguous
+                   && existingBlocksPointers[i + run] == (existingBlocksPointers[i] == 0 ? 0 : existingBlocksPointers[i] + run)
+                   && readAheadBlock(FDT[fd].openFile, chunkStart + i + run) == NULL)
+                ++run;
+            if (existingBlocksPointers[i] == 0)
+                memset(dest, 0, run * B);
+            else
+                read_blocks(existingBlocksPointers[i], run, dest);
+            i += run;
+        }
+    }
+    scratchUsed = scratchMark;
+    return length;
+}
+
+int sfs_pread(int fd, char *buf, int length, int offset) {
+    SfsIovec iov = { buf, length > 0 ? length : 0 };
+    return sfs_preadv(fd, &iov, 1, offset);
+}
+
+int sfs_readv(int fd, const SfsIovec *iov, int iovcnt) {
+    int offset = fd >= 0 && fd < fdtSize ? FDT[fd].rwHeadPos : 0;
+    int length = iovecLength(iov, iovcnt);
+
+    // A read that starts where the previous one ended extends the streak of sequential reads, which prefetches a
+    // growing window of the blocks that come next
+    if (fd >= 0 && fd < fdtSize && FDT[fd].inodeNum >= 0 && flushInodeWrites(FDT[fd].inodeNum) == 0) {
+        FDT[fd].sequentialReads = offset == FDT[fd].lastReadEnd ? FDT[fd].sequentialReads + 1 : 0;
+        if (FDT[fd].sequentialReads > 0)
+            readAhead(fd, offset, length);
+    }
+
+    // Read from the read/write head, and move it past the data read
+    int bytesRead = sfs_preadv(fd, iov, iovcnt, offset);
+    if (bytesRead > 0) {
+        FDT[fd].rwHeadPos += bytesRead;
+        FDT[fd].lastReadEnd = FDT[fd].rwHeadPos;
+    }
+    return bytesRead;
+}
+
+int sfs_fread(int fd, char *buf, int length) {
+    SfsIovec iov = { buf, length > 0 ? length : 0 };
+    return sfs_readv(fd, &iov, 1);
+}
+
+int sfs_fseek(int fd, int loc) {
+    if (fd < 0 || fd >= fdtSize) {
+        fprintf(stderr, "Failed to seek in file: the file descriptor is outside the bounds of the FDT.\n");
         return -1;
     }
 
@@ -587,63 +2588,646 @@ int sfs_fseek(int fd, int loc) {
         return -1;
     }
 
-    // FDT[fd] points to valid open file
-    if (loc < 0 || loc > inodeTable[FDT[fd].inodeNum].size) {
+    // FDT[fd] points to valid open file (seeking past the end of the file is allowed, writing there leaves a hole)
+    if (loc < 0) {
         fprintf(stderr, "Failed to seek in file: the location to seek to is not valid for this file.\n");
         return -1;
     }
+    if (flushWriteBuffer(fd, FDT[fd].writeBufferLength) != 0) {
+        fprintf(stderr, "Failed to seek in file: the buffered writes could not be written.\n");
+        return -1;
+    }
     FDT[fd].rwHeadPos = loc;
     return 0;
 }
 
-int sfs_remove(char *filename) {
-    if (strlen(filename) > MAXFILENAME) {
-        fprintf(stderr, "Failed to remove file: File name is too long.\n");
+int sfs_fflush(int fd) {
+    if (fd < 0 || fd >= fdtSize) {
+        fprintf(stderr, "Failed to flush file: the file descriptor is outside the bounds of the FDT.\n");
         return -1;
     }
 
-    // Look up the file in the directory
-    int dir_pos = -1;
-    for (int i = 0; i < DIR_SIZE; ++i) {
-        if (strcmp(rootDirEntries[i].filename, filename) == 0) {
-            dir_pos = i;
-            rootDirEntries[i].used = 0;
-            break;
+    if (FDT[fd].inodeNum < 0) {
+        fprintf(stderr, "Failed to flush file: the file descriptor has no file associated.\n");
+        return -1;
+    }
+
+    // FDT[fd] points to valid open file, write its buffered appends
+    if (flushWriteBuffer(fd, FDT[fd].writeBufferLength) != 0) {
+        fprintf(stderr, "Failed to flush file: the buffered writes could not be written.\n");
+        return -1;
+    }
+    return 0;
+}
+
+int sfs_fsetbuffering(int fd, int enabled) {
+    if (fd < 0 || fd >= fdtSize) {
+        fprintf(stderr, "Failed to set buffering: the file descriptor is outside the bounds of the FDT.\n");
+        return -1;
+    }
+
+    if (FDT[fd].inodeNum < 0) {
+        fprintf(stderr, "Failed to set buffering: the file descriptor has no file associated.\n");
+        return -1;
+    }
+
+    // FDT[fd] points to valid open file, writes are unbuffered from now on if buffering is turned off
+    if (!enabled && sfs_fflush(fd) != 0)
+        return -1;
+    FDT[fd].writeBuffering = enabled != 0;
+    return 0;
+}
+
+void *sfs_mmap(int fd, int offset, int length, int flags) {
+    if (fd < 0 || fd >= fdtSize) {
+        fprintf(stderr, "Failed to map file: the file descriptor is outside the bounds of the FDT.\n");
+        return NULL;
+    }
+
+    if (FDT[fd].inodeNum < 0) {
+        fprintf(stderr, "Failed to map file: the file descriptor has no file associated.\n");
+        return NULL;
+    }
+
+    if (offset < 0 || length < 1) {
+        fprintf(stderr, "Failed to map file: the range to map is not valid.\n");
+        return NULL;
+    }
+
+    if (flags != SFS_MAP_SHARED && flags != SFS_MAP_PRIVATE) {
+        fprintf(stderr, "Failed to map file: the flags are not valid.\n");
+        return NULL;
+    }
+
+    // The disk emulator has no memory-mapped backend, so the range is copied in (the part past the end of the file
+    // reads as zeros) and written back by sfs_msync()
+    Mapping *mapping = (Mapping *) malloc(sizeof(Mapping));
+    Byte *data = (Byte *) malloc(length);
+    if (mapping == NULL || data == NULL) {
+        fprintf(stderr, "Failed to map file: ran out of memory while trying to map the file.\n");
+        free(mapping);
+        free(data);
+        return NULL;
+    }
+    int bytesRead = sfs_pread(fd, data, length, offset);
+    if (bytesRead < 0) {
+        fprintf(stderr, "Failed to map file: the range could not be read.\n");
+        free(mapping);
+        free(data);
+        return NULL;
+    }
+    memset(data + bytesRead, 0, length - bytesRead);
+
+    mapping->data = data;
+    mapping->fd = fd;
+    mapping->offset = offset;
+    mapping->length = length;
+    mapping->flags = flags;
+    mapping->next = mappings;
+    mappings = mapping;
+    return data;
+}
+
+int sfs_msync(void *addr, int length) {
+    Mapping **link = findMapping(addr);
+    if (link == NULL) {
+        fprintf(stderr, "Failed to sync mapping: the address is not in a mapped range.\n");
+        return -1;
+    }
+
+    // Only shared mappings are written back, and only up to the end of the file (a mapping doesn't extend it)
+    Mapping *mapping = *link;
+    if (mapping->flags != SFS_MAP_SHARED || length < 1)
+        return 0;
+    int from = mapping->offset + ((Byte *) addr - mapping->data);
+    int to = from + length < mapping->offset + mapping->length ? from + length : mapping->offset + mapping->length;
+    if (flushInodeWrites(FDT[mapping->fd].inodeNum) != 0) {
+        fprintf(stderr, "Failed to sync mapping: the buffered writes could not be written.\n");
+        return -1;
+    }
+    int size = inodeTable[FDT[mapping->fd].inodeNum].size;
+    if (to > size)
+        to = size;
+    if (from < to && sfs_pwrite(mapping->fd, (char *) addr, to - from, from) != to - from) {
+        fprintf(stderr, "Failed to sync mapping: the range could not be written.\n");
+        return -1;
+    }
+    return 0;
+}
+
+int sfs_munmap(void *addr) {
+    Mapping **link = findMapping(addr);
+    if (link == NULL || (*link)->data != addr) {
+        fprintf(stderr, "Failed to unmap: the address is not the start of a mapped range.\n");
+        return -1;
+    }
+
+    // Write the mapping back and release it (even if it can't be written)
+    Mapping *mapping = *link;
+    int res = sfs_msync(mapping->data, mapping->length);
+    *link = mapping->next;
+    free(mapping->data);
+    free(mapping);
+    return res;
+}
+
+int sfs_ftruncate(int fd, int size) {
+    if (fd < 0 || fd >= fdtSize) {
+        fprintf(stderr, "Failed to truncate file: the file descriptor is outside the bounds of the FDT.\n");
+        return -1;
+    }
+
+    if (FDT[fd].inodeNum < 0) {
+        fprintf(stderr, "Failed to truncate file: the file descriptor has no file associated.\n");
+        return -1;
+    }
+
+    if (size < 0) {
+        fprintf(stderr, "Failed to truncate file: the size is negative.\n");
+        return -1;
+    }
+
+    // FDT[fd] points to valid open file (its buffered appends are written first, they may extend it)
+    int inodeNum = FDT[fd].inodeNum;
+    if (flushInodeWrites(inodeNum) != 0) {
+        fprintf(stderr, "Failed to truncate file: the buffered writes could not be written.\n");
+        return -1;
+    }
+    Inode inode = inodeTable[inodeNum];
+
+    if (inode.header.flags & INODE_INLINE_DATA && size > INLINE_DATA_SIZE) {
+        // The file is outgrowing its inline data, move the data to a data block of its own (the rest is a hole)
+        Byte inlineBlock[B];
+        memset(inlineBlock, 0, B);
+        memcpy(inlineBlock, INLINE_DATA(&inode), inode.size);
+        memset(&inode.header, 0, sizeof(ExtentHeader) + sizeof(inode.extents));
+        if (inode.size > 0) {
+            int inlineBlockPointer = sfs_allocateFreeDataBlock();
+            if (inlineBlockPointer < 0 || setInodeBlockPointers(&inode, &inlineBlockPointer, 0, 1) != 0) {
+                fprintf(stderr, "Failed to truncate file: could not allocate a data block for the inline data.\n");
+                if (inlineBlockPointer >= 0)
+                    sfs_freeDataBlock(inlineBlockPointer);
+                return -1;
+            }
+            write_blocks(inlineBlockPointer, 1, inlineBlock);
+            write_blocks(superBlock.sfsSize - superBlock.fbmSize, superBlock.fbmSize, fbm);
+        }
+        inode.size = size;
+        inodeTable[inodeNum] = inode;
+        writeInode(inodeNum);
+        invalidateBlockMaps(inodeNum);
+        return 0;
+    }
+
+    if (size >= inode.size || inode.header.flags & INODE_INLINE_DATA) {
+        // Growing a file only leaves a hole at its end, and shrinking inline data only needs the bytes past the new end
+        // zeroed (bytes past the end of a file are always zero, so that extending it again reads back zeros)
+        if (size < inode.size)
+            memset(INLINE_DATA(&inode) + size, 0, inode.size - size);
+        inode.size = size;
+        inodeTable[inodeNum] = inode;
+        writeInode(inodeNum);
+        return 0;
+    }
+
+    // Zero the rest of the new last block, if it is partially cut and not a hole
+    int keptBlocks = ceil((double)size / B);
+    if (size % B != 0) {
+        int lastBlockPointer;
+        if (getFileBlockPointers(fd, &lastBlockPointer, keptBlocks - 1, 1) < 0)
+            return -1;
+        if (lastBlockPointer != 0) {
+            Byte lastBlockData[B];
+            read_blocks(lastBlockPointer, 1, lastBlockData);
+            memset(lastBlockData + size % B, 0, B - size % B);
+            write_blocks(lastBlockPointer, 1, lastBlockData);
+        }
+    }
+
+    // Find the extents that end past the new last block in the file's block map, they hold the blocks cut off
+    if (loadBlockMap(fd) != 0)
+        return -1;
+    OpenFile *openFile = FDT[fd].openFile;
+    Extent *blockMap = openFile->blockMap;
+    int entries = openFile->blockMapEntries;
+    int firstCut = entries;
+    while (firstCut > 0 && blockMap[firstCut - 1].logicalStart + blockMap[firstCut - 1].length > keptBlocks)
+        --firstCut;
+
+    // Cut them out of the extent tree, which only rewrites the nodes covering the blocks cut off
+    if (firstCut < entries) {
+        Extent last = blockMap[entries - 1];
+        if (updateExtentTree(&inode, keptBlocks, last.logicalStart + last.length, NULL, 0) != 0) {
+            fprintf(stderr, "Failed to truncate file: could not update the extents.\n");
+            return -1;
+        }
+    }
+    if (size == 0) // An empty file goes back to storing its data inline, like a new file
+        inode.header.flags = INODE_INLINE_DATA;
+
+    // Write the inode before releasing the blocks cut off, so it never points to blocks marked free on disk
+    inode.size = size;
+    inodeTable[inodeNum] = inode;
+    writeInode(inodeNum);
+    dropReadAhead(inodeNum);
+
+    for (int i = firstCut; i < entries; ++i) {
+        int from = blockMap[i].logicalStart < keptBlocks ? keptBlocks - blockMap[i].logicalStart : 0;
+        for (int j = from; j < blockMap[i].length; ++j) {
+            sfs_freeDataBlock(blockMap[i].physicalStart + j);
+        }
+    }
+
+    // Cut the block map the same way, rather than decoding it again (the extent holding the new last block is kept)
+    if (firstCut < entries && blockMap[firstCut].logicalStart < keptBlocks) {
+        blockMap[firstCut].length = keptBlocks - blockMap[firstCut].logicalStart;
+        ++firstCut;
+    }
+    openFile->blockMapEntries = firstCut;
+    write_blocks(superBlock.sfsSize - superBlock.fbmSize, superBlock.fbmSize, fbm);
+    return 0;
+}
+
+// Returns the offset of the first byte of data (if `wantData`) or of a hole at or after `loc` in the open file at `fd`,
+// at the granularity of blocks. The end of the file counts as a hole, and -1 is returned if there is no data after `loc`.
+int seekDataOrHole(int fd, int loc, int wantData) {
+    if (fd < 0 || fd >= fdtSize) {
+        fprintf(stderr, "Failed to seek in file: the file descriptor is outside the bounds of the FDT.\n");
+        return -1;
+    }
+
+    if (FDT[fd].inodeNum < 0) {
+        fprintf(stderr, "Failed to seek in file: the file descriptor has no file associated.\n");
+        return -1;
+    }
+
+    if (flushInodeWrites(FDT[fd].inodeNum) != 0) {
+        fprintf(stderr, "Failed to seek in file: the buffered writes could not be written.\n");
+        return -1;
+    }
+    Inode *inode = &inodeTable[FDT[fd].inodeNum];
+    if (loc < 0 || loc >= inode->size) // Nothing but the hole at the end of the file past its end
+        return -1;
+
+    if (inode->header.flags & INODE_INLINE_DATA) { // Inline data has no holes
+        FDT[fd].rwHeadPos = wantData ? loc : inode->size;
+        return FDT[fd].rwHeadPos;
+    }
+
+    if (loadBlockMap(fd) != 0)
+        return -1;
+
+    // Find the first extent that ends after the block holding `loc`
+    Extent *extents = FDT[fd].openFile->blockMap;
+    int entries = FDT[fd].openFile->blockMapEntries;
+    int block = loc / B;
+    int i = 0;
+    while (i < entries && extents[i].logicalStart + extents[i].length <= block)
+        ++i;
+
+    int pos;
+    if (wantData) {
+        if (i == entries) // Only a hole up to the end of the file
+            return -1;
+        pos = extents[i].logicalStart <= block ? loc : extents[i].logicalStart * B;
+    } else {
+        if (i == entries || extents[i].logicalStart > block) { // `loc` is in a hole already
+            pos = loc;
+        } else { // Skip to the end of the segment of data holding `loc`
+            int end = extents[i].logicalStart + extents[i].length;
+            while (++i < entries && extents[i].logicalStart == end)
+                end += extents[i].length;
+            pos = end * B;
         }
+        if (pos > inode->size)
+            pos = inode->size;
     }
 
+    FDT[fd].rwHeadPos = pos;
+    return pos;
+}
+
+int sfs_fseekdata(int fd, int loc) {
+    return seekDataOrHole(fd, loc, 1);
+}
+
+int sfs_fseekhole(int fd, int loc) {
+    return seekDataOrHole(fd, loc, 0);
+}
+
+int sfs_remove(char *filename) {
+    // Look up the file in its directory
+    char name[MAXFILENAME + 1];
+    Directory *dir = resolveParent(filename, name);
+    int dir_pos = dir == NULL ? -1 : dirIndexLookup(&dir->index, dir->records, name);
     if (dir_pos < 0) {
         fprintf(stderr, "Failed to remove file: File does not exist.\n");
         return -1;
     }
+    int inodeNum = dirRecord(dir, dir_pos)->inodeNum;
+    if (inodeTable[inodeNum].header.flags & INODE_DIRECTORY) {
+        fprintf(stderr, "Failed to remove file: '%s' is a directory.\n", filename);
+        return -1;
+    }
 
-    // File exists, remove it
-    // Get Inode
-    Inode inode = inodeTable[rootDirEntries[dir_pos].inodeNum];
-    
-    // Release data blocks
-    int totalBlocks = ceil((double)inode.size / B);
-    int existingBlocksPointers[totalBlocks];
-    getInodeBlockPointers(inode, existingBlocksPointers, totalBlocks);
-    
-    for (int i = 0; i < totalBlocks; ++i) {
-        if (sfs_freeDataBlock(existingBlocksPointers[i]) != 0) {
-            fprintf(stderr, "Failed to remove file: inode data block %d could not be freed.\n", i);
+    // File exists, remove it (its data blocks and inode are released once it isn't open anymore)
+    removeDirEntry(dir, dir_pos);
+    releaseFile(inodeNum);
+    return 0;
+}
+
+int sfs_mkdir(char *path) {
+    char name[MAXFILENAME + 1];
+    Directory *parent = resolveParent(path, name);
+    if (parent == NULL) {
+        fprintf(stderr, "Failed to create directory: the parent of '%s' could not be resolved.\n", path);
+        return -1;
+    }
+    if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        fprintf(stderr, "Failed to create directory: '%s' is not a valid directory name.\n", path);
+        return -1;
+    }
+    if (dirIndexLookup(&parent->index, parent->records, name) >= 0) {
+        fprintf(stderr, "Failed to create directory: '%s' already exists.\n", path);
+        return -1;
+    }
+
+    int inodeNum = sfs_allocateInode();
+    if (inodeNum < 0) {
+        fprintf(stderr, "Failed to create directory: There are no free inodes.\n");
+        return -1;
+    }
+
+    // New directories are empty, and grow as entries are added to them
+    Inode *inode = &inodeTable[inodeNum];
+    memset(inode, 0, sizeof(Inode));
+    inode->header.flags = INODE_DIRECTORY;
+
+    if (addDirEntry(parent, name, inodeNum) < 0) {
+        fprintf(stderr, "Failed to create directory: Could not add the directory to its parent.\n");
+        sfs_freeInode(inodeNum);
+        return -1;
+    }
+    writeInode(inodeNum);
+    return 0;
+}
+
+int sfs_rmdir(char *path) {
+    char name[MAXFILENAME + 1];
+    Directory *parent = resolveParent(path, name);
+    int dir_pos = parent == NULL || name[0] == '\0' ? -1 : dirIndexLookup(&parent->index, parent->records, name);
+    if (dir_pos < 0) {
+        fprintf(stderr, "Failed to remove directory: '%s' does not exist (or is the root directory).\n", path);
+        return -1;
+    }
+    int inodeNum = dirRecord(parent, dir_pos)->inodeNum;
+    if (!(inodeTable[inodeNum].header.flags & INODE_DIRECTORY)) {
+        fprintf(stderr, "Failed to remove directory: '%s' is not a directory.\n", path);
+        return -1;
+    }
+
+    Directory *dir = getDirectory(inodeNum);
+    if (dir == NULL)
+        return -1;
+    if (dir->index.count > 0) {
+        fprintf(stderr, "Failed to remove directory: '%s' is not empty.\n", path);
+        return -1;
+    }
+
+    // Directory exists and is empty, remove it (the cached path resolution may go through it)
+    removeDirEntry(parent, dir_pos);
+    unloadDirectory(dir);
+    free(dir);
+    dirCache[inodeNum] = NULL;
+    cachedParent = NULL;
+
+    freeInodeBlocks(&inodeTable[inodeNum]);
+    sfs_freeInode(inodeNum);
+    writeInode(inodeNum);
+    write_blocks(superBlock.sfsSize - superBlock.fbmSize, superBlock.fbmSize, fbm);
+    return 0;
+}
+
+int sfs_rename(char *oldPath, char *newPath) {
+    // Look up the file or directory being renamed
+    char oldName[MAXFILENAME + 1];
+    Directory *oldParent = resolveParent(oldPath, oldName);
+    int old_pos = oldParent == NULL || oldName[0] == '\0' ? -1 : dirIndexLookup(&oldParent->index, oldParent->records, oldName);
+    if (old_pos < 0) {
+        fprintf(stderr, "Failed to rename: '%s' does not exist (or is the root directory).\n", oldPath);
+        return -1;
+    }
+    int inodeNum = dirRecord(oldParent, old_pos)->inodeNum;
+    int isDir = (inodeTable[inodeNum].header.flags & INODE_DIRECTORY) != 0;
+
+    char newName[MAXFILENAME + 1];
+    Directory *newParent = resolveParent(newPath, newName);
+    if (newParent == NULL) {
+        fprintf(stderr, "Failed to rename: the parent of '%s' could not be resolved.\n", newPath);
+        return -1;
+    }
+    if (newName[0] == '\0' || strcmp(newName, ".") == 0 || strcmp(newName, "..") == 0) {
+        fprintf(stderr, "Failed to rename: '%s' is not a valid name.\n", newPath);
+        return -1;
+    }
+    if (newParent == oldParent && strcmp(newName, oldName) == 0) // Renamed to itself
+        return 0;
+    if (isDir && pathGoesThrough(newPath, inodeNum)) {
+        fprintf(stderr, "Failed to rename: '%s' can't be moved inside itself.\n", oldPath);
+        return -1;
+    }
+
+    // A target that exists is replaced, as long as it is the same kind as the source (and empty, if a directory)
+    int new_pos = dirIndexLookup(&newParent->index, newParent->records, newName);
+    int replacedInode = -1;
+    if (new_pos >= 0) {
+        replacedInode = dirRecord(newParent, new_pos)->inodeNum;
+        int replacedIsDir = (inodeTable[replacedInode].header.flags & INODE_DIRECTORY) != 0;
+        if (replacedIsDir != isDir) {
+            fprintf(stderr, "Failed to rename: '%s' is %sa directory.\n", newPath, replacedIsDir ? "" : "not ");
             return -1;
         }
+        if (replacedIsDir) {
+            Directory *replacedDir = getDirectory(replacedInode);
+            if (replacedDir == NULL)
+                return -1;
+            if (replacedDir->index.count > 0) {
+                fprintf(stderr, "Failed to rename: '%s' is not empty.\n", newPath);
+                return -1;
+            }
+        }
     }
-    if (totalBlocks > 12 && sfs_freeDataBlock(existingBlocksPointers[12]) != 0) { // Need to free the indirect pointer block as well
-        fprintf(stderr, "Failed to remove file: inode data block %d could not be freed.\n", 12);
+
+    // Point the new name at the inode first, so that the file is always reachable by at least one of its names. Only
+    // directory records are written, the file's inode and data are left as they are.
+    if (new_pos >= 0) { // Reuse the target's record, which already holds the new name
+        dirRecord(newParent, new_pos)->inodeNum = inodeNum;
+        writeDirBlock(newParent, new_pos / B);
+    } else if (addDirEntry(newParent, newName, inodeNum) < 0) {
+        fprintf(stderr, "Failed to rename: Could not add '%s' to its directory.\n", newPath);
         return -1;
     }
-    
-    // Release inode
-    inode.size = -1;
-    
-    // Write changes to disk
-    int dirSizeInBlocks = ceil((double)superBlock.rootDir.size / B);
-    write_blocks(superBlock.rootDir.blockPointers[0], dirSizeInBlocks - 1, rootDirEntries);
-    write_blocks(1, superBlock.inodeTableSize, inodeTable);
-    write_blocks(superBlock.sfsSize - superBlock.fbmSize - 1, superBlock.fbmSize, fbm);
+    removeDirEntry(oldParent, old_pos);
+    if (isDir) // Paths through the directory have changed
+        cachedParent = NULL;
+
+    // Release the replaced target
+    if (replacedInode >= 0) {
+        if (isDir) {
+            unloadDirectory(dirCache[replacedInode]);
+            free(dirCache[replacedInode]);
+            dirCache[replacedInode] = NULL;
+        }
+        releaseFile(replacedInode);
+    }
     return 0;
 }
+
+int sfs_readdirplus(const char *path, int *cursor, SfsDirEntry *entries, int maxEntries) {
+    Directory *dir = resolveDirectory(path);
+    if (dir == NULL) {
+        fprintf(stderr, "Failed to read directory: '%s' is not a directory.\n", path);
+        return -1;
+    }
+
+    // Fill entries from the cursor (the offset of the record after the last one returned), the path is only resolved once per batch
+    int filled = 0;
+    int end = dir->blocks * B;
+    int offset = nextDirRecord(dir, *cursor);
+    for (; offset < end && filled < maxEntries; offset += dirRecord(dir, offset)->recordLength) {
+        DirRecord *record = dirRecord(dir, offset);
+        if (record->nameLength != 0) {
+            flushInodeWrites(record->inodeNum); // The size includes the appends that are still buffered
+            Inode *inode = &inodeTable[record->inodeNum];
+            SfsDirEntry *entry = &entries[filled++];
+            memcpy(entry->name, record->name, record->nameLength);
+            entry->name[record->nameLength] = '\0';
+            entry->inode = record->inodeNum;
+            entry->size = inode->size;
+            entry->isDir = (inode->header.flags & INODE_DIRECTORY) != 0;
+        }
+    }
+    *cursor = offset < end ? offset : end;
+    return filled;
+}
+
+int sfs_readdir(const char *path, int *cursor, char *filename) {
+    SfsDirEntry entry;
+    int res = sfs_readdirplus(path, cursor, &entry, 1);
+    if (res == 1)
+        strcpy(filename, entry.name);
+    return res;
+}
+
+int sfs_defrag(int maxBlocks) {
+    int relocated = 0;
+    int blocksCopied = 0;
+
+    for (int n = 0; n < superBlock.inodeCount; ++n) {
+        int inodeNum = defragCursor;
+        Inode inode = inodeTable[inodeNum];
+        if (inode.size <= 0) { // Free or empty inode
+            defragCursor = (defragCursor + 1) % superBlock.inodeCount;
+            continue;
+        }
+
+        // Measure how fragmented the file is (each extent is a run of contiguous blocks), and skip it if its blocks
+        // are already in long enough runs, or if it can't have fewer runs (a sparse file needs a run per segment of
+        // data between holes)
+        Extent *extents;
+        int runs = loadExtents(&inode, &extents, 0);
+        if (runs < 0)
+            return -1;
+        int totalBlocks = 0;
+        int segments = runs > 0;
+        for (int i = 0; i < runs; ++i) {
+            totalBlocks += extents[i].length;
+            if (i > 0 && extents[i - 1].logicalStart + extents[i - 1].length != extents[i].logicalStart)
+                ++segments;
+        }
+        if (runs <= segments || totalBlocks / runs >= DEFRAG_MIN_AVG_RUN) {
+            free(extents);
+            defragCursor = (defragCursor + 1) % superBlock.inodeCount;
+            continue;
+        }
+
+        // Throttle - stop once this call has copied `maxBlocks` blocks, and resume from this file on the next call
+        // (a file is always relocated if nothing has been copied yet, so files bigger than `maxBlocks` still progress)
+        if (maxBlocks > 0 && blocksCopied > 0 && blocksCopied + totalBlocks > maxBlocks) {
+            free(extents);
+            break;
+        }
+
+        // Find a contiguous run for the data blocks
+        int newStart = sfs_allocateContiguousDataBlocks(totalBlocks);
+        if (newStart < 0) { // No free run is large enough, leave the file as it is
+            free(extents);
+            defragCursor = (defragCursor + 1) % superBlock.inodeCount;
+            continue;
+        }
+
+        Byte *data = (Byte *) malloc(totalBlocks * B);
+        Extent *newExtents = (Extent *) malloc(segments * sizeof(Extent));
+        if (data == NULL || newExtents == NULL) {
+            fprintf(stderr, "Failed to defragment: ran out of memory while trying to copy inode %d.\n", inodeNum);
+            for (int i = 0; i < totalBlocks; ++i) {
+                sfs_freeDataBlock(newStart + i);
+            }
+            free(data);
+            free(newExtents);
+            free(extents);
+            return -1;
+        }
+
+        // Copy the data into the new run in logical order (skipping holes), reading each of the existing extents with
+        // a single read, and map each segment of data to its part of the run
+        int newEntries = 0;
+        int offset = 0;
+        for (int i = 0; i < runs; ++i) {
+            read_blocks(extents[i].physicalStart, extents[i].length, data + offset * B);
+            if (newEntries > 0 && extents[i - 1].logicalStart + extents[i - 1].length == extents[i].logicalStart) {
+                newExtents[newEntries - 1].length += extents[i].length;
+            } else {
+                Extent segment = { extents[i].logicalStart, newStart + offset, extents[i].length };
+                newExtents[newEntries++] = segment;
+            }
+            offset += extents[i].length;
+        }
+        write_blocks(newStart, totalBlocks, data);
+        free(data);
+
+        // Persist in an order that never leaves the inode pointing at blocks marked free on disk: first the bitmap
+        // with both the old and new blocks allocated, then the inode (now a single extent per segment), and only then
+        // release the old blocks
+        write_blocks(superBlock.sfsSize - superBlock.fbmSize, superBlock.fbmSize, fbm);
+        if (storeExtents(&inode, newExtents, newEntries) != 0) {
+            // The inode still maps the old blocks, so only the new run is released
+            fprintf(stderr, "Failed to defragment: could not map inode %d to its new blocks.\n", inodeNum);
+            for (int i = 0; i < totalBlocks; ++i) {
+                sfs_freeDataBlock(newStart + i);
+            }
+            write_blocks(superBlock.sfsSize - superBlock.fbmSize, superBlock.fbmSize, fbm);
+            free(newExtents);
+            free(extents);
+            return -1;
+        }
+        free(newExtents);
+        inodeTable[inodeNum] = inode;
+        writeInode(inodeNum);
+        invalidateBlockMaps(inodeNum);
+
+        for (int i = 0; i < runs; ++i) {
+            for (int j = 0; j < extents[i].length; ++j) {
+                sfs_freeDataBlock(extents[i].physicalStart + j);
+            }
+        }
+        free(extents);
+        write_blocks(superBlock.sfsSize - superBlock.fbmSize, superBlock.fbmSize, fbm);
+
+        blocksCopied += totalBlocks;
+        ++relocated;
+        defragCursor = (defragCursor + 1) % superBlock.inodeCount;
+    }
+
+    return relocated;
+}
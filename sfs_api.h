@@ -1,14 +1,34 @@
 #ifndef SFS_API_H
 #define SFS_API_H
 
-#define MAXFILENAME 32
+#define MAXFILENAME 255 // Max length of a file or directory name (a single path component)
+#define MAXPATHNAME 4096 // Max length of a path
+
+#define SFS_MAP_PRIVATE 0 // sfs_mmap() flag: changes made to the mapping are never written back to the file
+#define SFS_MAP_SHARED 1 // sfs_mmap() flag: changes made to the mapping are written back by sfs_msync()/sfs_munmap()
+
+// A directory entry with its attributes, filled in batches by `sfs_readdirplus`
+typedef struct SfsDirEntry {
+    char name[MAXFILENAME + 1];
+    int inode;
+    int size;
+    int isDir;
+} SfsDirEntry;
+
+// A buffer of a vectored read or write (`sfs_readv`, `sfs_writev` and their positional variants)
+typedef struct SfsIovec {
+    void *base;
+    int length;
+} SfsIovec;
 
 void mksfs(int);
 
-int sfs_getnextfilename(char*);
+int sfs_getnextfilename(char*); // Fills a buffer of `MAXFILENAME + 1` bytes
 
 int sfs_getfilesize(const char*);
 
+int sfs_isdir(const char*);
+
 int sfs_fopen(char*);
 
 int sfs_fclose(int);
@@ -17,8 +37,48 @@ int sfs_fwrite(int, const char*, int);
 
 int sfs_fread(int, char*, int);
 
+int sfs_pwrite(int, const char*, int, int);
+
+int sfs_pread(int, char*, int, int);
+
+int sfs_writev(int, const SfsIovec*, int);
+
+int sfs_readv(int, const SfsIovec*, int);
+
+int sfs_pwritev(int, const SfsIovec*, int, int);
+
+int sfs_preadv(int, const SfsIovec*, int, int);
+
 int sfs_fseek(int, int);
 
+int sfs_fseekdata(int, int);
+
+int sfs_fseekhole(int, int);
+
+int sfs_fflush(int);
+
+int sfs_fsetbuffering(int, int);
+
+void *sfs_mmap(int, int, int, int);
+
+int sfs_msync(void*, int);
+
+int sfs_munmap(void*);
+
+int sfs_ftruncate(int, int);
+
 int sfs_remove(char*);
 
+int sfs_rename(char*, char*);
+
+int sfs_mkdir(char*);
+
+int sfs_rmdir(char*);
+
+int sfs_readdir(const char*, int*, char*); // Fills a buffer of `MAXFILENAME + 1` bytes
+
+int sfs_readdirplus(const char*, int*, SfsDirEntry*, int);
+
+int sfs_defrag(int);
+
 #endif
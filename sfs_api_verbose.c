@@ -20,6 +20,7 @@
 #define DIR_SIZE 2048  // Max directory size (number of files) - calculated by running 'python calc_disk_alloc.py <Q>'
 #define MAX_FILE_SIZE (268 * B)
 #define FDT_SIZE 10
+#define FILENAME_LENGTH 32 // Max length of a file name - this snapshot keeps its own, `MAXFILENAME` has grown since
 char DISKNAME[] = "SFS_DISK";
 
 
@@ -43,7 +44,7 @@ typedef struct SuperBlock {
 
 typedef struct DirEntry {
     Byte used;
-    char filename[MAXFILENAME + 1];
+    char filename[FILENAME_LENGTH + 1];
     short inodeNum;
 } DirEntry;
 
@@ -333,7 +334,7 @@ int sfs_getnextfilename(char *filename) {
     // Look up the next used directory entry (= next file)
     for (int i = currentFileIndex; i < DIR_SIZE; ++i) {
         if (rootDirEntries[i].used == 1) {
-            if (strncpy(filename, rootDirEntries[i].filename, MAXFILENAME) == NULL) {
+            if (strncpy(filename, rootDirEntries[i].filename, FILENAME_LENGTH) == NULL) {
                 fprintf(stderr, "Failed to get filename: strcpy failed.\n");
                 return -1;
             }
@@ -349,7 +350,7 @@ int sfs_getnextfilename(char *filename) {
 
 int sfs_getfilesize(const char *filename) {
     printf("sfs_getfilesize: attempting get file size for '%s'\n", filename);
-    if (strlen(filename) > MAXFILENAME) {
+    if (strlen(filename) > FILENAME_LENGTH) {
         fprintf(stderr, "Failed to get file size: File name is too long.\n");
         return -1;
     }
@@ -375,7 +376,7 @@ int sfs_getfilesize(const char *filename) {
 
 int sfs_fopen(char *filename) {
     printf("sfs_fopen: attempting to open '%s'\n", filename);
-    if (strlen(filename) > MAXFILENAME) {
+    if (strlen(filename) > FILENAME_LENGTH) {
         fprintf(stderr, "Failed to open file: File name is too long.\n");
         return -1;
     }
@@ -747,7 +748,7 @@ int sfs_fseek(int fd, int loc) {
 
 int sfs_remove(char *filename) {
     printf("sfs_remove: attempting to remove '%s'\n", filename);
-    if (strlen(filename) > MAXFILENAME) {
+    if (strlen(filename) > FILENAME_LENGTH) {
         fprintf(stderr, "Failed to remove file: File name is too long.\n");
         return -1;
     }
@@ -89,10 +89,11 @@ main(int argc, char **argv)
       error_count++;
     } 
     tmp = sfs_fopen(names[i]);
-    if (tmp >= 0 && tmp != fds[i]) {
-      fprintf(stderr, "ERROR: file %s was opened twice\n", names[i]);
+    if (tmp < 0 || tmp == fds[i]) {
+      fprintf(stderr, "ERROR: file %s was not opened in a descriptor of its own\n", names[i]);
       error_count++;
     }
+    sfs_fclose(tmp);
     filesize[i] = (rand() % (MAX_BYTES-MIN_BYTES)) + MIN_BYTES;
   }
 
@@ -82,10 +82,10 @@ main(int argc, char **argv)
   /* First we open two files and attempt to write data to them.
    */
   {
-  char fname[MAX_FNAME_LENGTH+10];
+  char fname[MAXFILENAME+11];
   int i;
 
-  for (i = 0; i < MAX_FNAME_LENGTH+10; i++) {
+  for (i = 0; i < MAXFILENAME+10; i++) {
     if (i != 8) {
       fname[i] = 'A' + (rand() % 26);
     }
@@ -110,10 +110,11 @@ main(int argc, char **argv)
       error_count++;
     }
     tmp = sfs_fopen(names[i]);
-    if (tmp >= 0 && tmp != fds[i]) {
-      fprintf(stderr, "ERROR: file %s was opened twice\n", names[i]);
+    if (tmp < 0 || tmp == fds[i]) {
+      fprintf(stderr, "ERROR: file %s was not opened in a descriptor of its own\n", names[i]);
       error_count++;
     }
+    sfs_fclose(tmp);
     filesize[i] = (rand() % (MAX_BYTES-MIN_BYTES)) + MIN_BYTES;
   }
 
@@ -376,7 +377,7 @@ main(int argc, char **argv)
   }
 
   printf("Directory listing\n");
-  char *filename = (char *)malloc(MAXFILENAME);
+  char *filename = (char *)malloc(MAXFILENAME + 1);
   int max = 0;
   while (sfs_getnextfilename(filename)) {
 	  if (strcmp(filename, names[max]) != 0) {
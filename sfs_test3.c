@@ -0,0 +1,594 @@
+/* sfs_test3.c
+ *
+ * Behaviour checks for the API added on top of the assignment's, one
+ * section per feature. Everything written is read back once more after
+ * remounting the disk.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+
+#define BLOCK 1024
+#define FRAG_BLOCKS 64          /* Blocks in each of the files fragmented for sfs_defrag() */
+#define LARGE_BLOCKS 300        /* Blocks in a file larger than direct and indirect pointers could map */
+#define DEEP_BLOCKS 400         /* Extents in files that need two levels of extent tree nodes */
+#define CHURN_FILES 3000        /* Files created and removed in turn, more than the inode table holds */
+#define INDEXED_FILES 200       /* Files looked up through the filename index */
+#define MANY_FILES 2100         /* Files in one directory, more than the inode table region holds */
+#define LONG_FILES 40           /* Files with the longest names, spread over several directory blocks */
+#define OPEN_FILES 40           /* Files open at once, more than the initial descriptor table holds */
+#define AHEAD_BLOCKS 48         /* Blocks in the file read sequentially in small pieces */
+
+static int error_count = 0;
+static const char zeros[BLOCK];
+
+static void check(int ok, const char *what)
+{
+  if (!ok) {
+    fprintf(stderr, "ERROR: %s\n", what);
+    error_count++;
+  }
+}
+
+static void fill_block(char *buffer, int seed)
+{
+  int i;
+  for (i = 0; i < BLOCK; i++)
+    buffer[i] = (char)(seed * 31 + i);
+}
+
+/* Returns 1 if the `length` bytes of `path` from `offset` match `expected`.
+ */
+static int file_matches(char *path, int offset, const char *expected, int length)
+{
+  char *buffer = malloc(length);
+  int fd = sfs_fopen(path);
+  int ok = fd >= 0 && buffer != NULL && sfs_fseek(fd, offset) == 0
+    && sfs_fread(fd, buffer, length) == length
+    && memcmp(buffer, expected, length) == 0;
+  if (fd >= 0)
+    sfs_fclose(fd);
+  free(buffer);
+  return ok;
+}
+
+/* Returns 1 if block `i` of the first `count` blocks of `path` holds the
+ * block filled from `seed + i`.
+ */
+static int blocks_match(char *path, int seed, int count)
+{
+  char expected[BLOCK], actual[BLOCK];
+  int i, fd = sfs_fopen(path);
+  int ok = fd >= 0 && sfs_fseek(fd, 0) == 0;
+  for (i = 0; ok && i < count; i++) {
+    fill_block(expected, seed + i);
+    ok = sfs_fread(fd, actual, BLOCK) == BLOCK && memcmp(actual, expected, BLOCK) == 0;
+  }
+  if (fd >= 0)
+    sfs_fclose(fd);
+  return ok;
+}
+
+/* Writes the `i`th name of the longest length allowed, in `/long`, to `path`.
+ */
+static void long_name(char *path, int i)
+{
+  sprintf(path, "/long/%03d", i);
+  memset(path + 9, 'x', MAXFILENAME - 3);
+  path[6 + MAXFILENAME] = '\0';
+}
+
+int
+main(int argc, char **argv)
+{
+  char buffer[4 * BLOCK];
+  char block[BLOCK];
+  char name[64];
+  char path[MAXFILENAME + 16];
+  int fd, fd2, i;
+  int res;
+
+  mksfs(1);
+
+  /* Two files appended to in turns end up fragmented, sfs_defrag() moves
+   * them to contiguous runs without changing their data.
+   */
+  fd = sfs_fopen("frag1");
+  fd2 = sfs_fopen("frag2");
+  for (i = 0; i < FRAG_BLOCKS; i++) {
+    fill_block(block, i);
+    sfs_fwrite(fd, block, BLOCK);
+    fill_block(block, 100 + i);
+    sfs_fwrite(fd2, block, BLOCK);
+  }
+  sfs_fclose(fd);
+  sfs_fclose(fd2);
+  check(sfs_defrag(0) > 0, "sfs_defrag did not relocate the fragmented files");
+  check(blocks_match("frag1", 0, FRAG_BLOCKS), "defragmented file lost its data");
+
+  /* Files grow past the 268 blocks that direct and indirect pointers could
+   * map.
+   */
+  fd = sfs_fopen("large");
+  for (i = 0; i < LARGE_BLOCKS; i++) {
+    fill_block(block, 1000 + i);
+    sfs_fwrite(fd, block, BLOCK);
+  }
+  sfs_fclose(fd);
+  check(sfs_getfilesize("large") == LARGE_BLOCKS * BLOCK, "file did not grow past 268 blocks");
+  check(blocks_match("large", 1000, LARGE_BLOCKS), "large file lost its data");
+
+  /* Two files appended to a block at a time in turns are split into more
+   * extents than the inode and one level of extent tree nodes can hold.
+   */
+  fd = sfs_fopen("deep1");
+  fd2 = sfs_fopen("deep2");
+  sfs_fsetbuffering(fd, 0);
+  sfs_fsetbuffering(fd2, 0);
+  for (i = 0; i < DEEP_BLOCKS; i++) {
+    fill_block(block, 2000 + i);
+    sfs_fwrite(fd, block, BLOCK);
+    fill_block(block, 3000 + i);
+    sfs_fwrite(fd2, block, BLOCK);
+  }
+  sfs_fclose(fd);
+  sfs_fclose(fd2);
+  check(blocks_match("deep1", 2000, DEEP_BLOCKS) && blocks_match("deep2", 3000, DEEP_BLOCKS),
+        "file mapped by a two level extent tree lost its data");
+
+  /* Filling holes in the middle of a file split into that many extents
+   * merges them, and only rewrites the nodes on the path to them.
+   */
+  fd = sfs_fopen("holes");
+  for (i = 0; i < DEEP_BLOCKS; i++) {
+    fill_block(block, 4000 + 2 * i);
+    sfs_pwrite(fd, block, BLOCK, 2 * i * BLOCK);
+  }
+  for (i = DEEP_BLOCKS / 2; i < DEEP_BLOCKS / 2 + 20; i++) {
+    fill_block(block, 4000 + 2 * i + 1);
+    sfs_pwrite(fd, block, BLOCK, (2 * i + 1) * BLOCK);
+  }
+  fill_block(block, 4000 + 2 * DEEP_BLOCKS);
+  sfs_pwrite(fd, block, BLOCK, 2 * DEEP_BLOCKS * BLOCK);
+  sfs_fclose(fd);
+  for (i = 0; i <= 2 * DEEP_BLOCKS; i++) {
+    fill_block(block, 4000 + i);
+    if (i % 2 == 0 || (i >= DEEP_BLOCKS + 1 && i < DEEP_BLOCKS + 41)) {
+      if (!file_matches("holes", i * BLOCK, block, BLOCK)) {
+        check(0, "filling holes between extents lost data");
+        break;
+      }
+    } else if (!file_matches("holes", i * BLOCK, zeros, BLOCK)) {
+      check(0, "filling holes between extents filled others");
+      break;
+    }
+  }
+
+  /* Files of up to 48 bytes keep their data in the inode, and move it to a
+   * block once they grow past that.
+   */
+  fd = sfs_fopen("tiny");
+  sfs_fwrite(fd, "tiny file", 9);
+  sfs_fclose(fd);
+  check(sfs_getfilesize("tiny") == 9 && file_matches("tiny", 0, "tiny file", 9), "inline file lost its data");
+  fd = sfs_fopen("tiny");
+  memset(buffer, 't', 100);
+  sfs_fwrite(fd, buffer, 100);
+  sfs_fclose(fd);
+  check(sfs_getfilesize("tiny") == 109 && file_matches("tiny", 5, "filettt", 7),
+        "file moved out of the inode lost its data");
+  fd = sfs_fopen("tiny2");
+  sfs_fwrite(fd, "inline", 6);
+  check(sfs_pwrite(fd, "far", 3, 5 * BLOCK) == 3, "write past the block of inline data failed");
+  sfs_fclose(fd);
+  check(file_matches("tiny2", 0, "inline\0", 7) && file_matches("tiny2", 5 * BLOCK - 1, "\0far", 4),
+        "inline data moved to its own block by a later write lost its data");
+
+  /* Removing a file frees its inode, so creating and removing more files than
+   * the inode table holds never runs out of inodes.
+   */
+  for (i = 0; i < CHURN_FILES; i++) {
+    fd = sfs_fopen("churn");
+    if (fd < 0 || sfs_fclose(fd) != 0 || sfs_remove("churn") != 0) {
+      check(0, "creating and removing files ran out of inodes");
+      break;
+    }
+  }
+
+  /* Writes past the end leave a hole, which uses no blocks and reads back as
+   * zeros.
+   * Writes that would end past the largest file size are rejected.
+   */
+  fd = sfs_fopen("sparse");
+  check(sfs_fseek(fd, 100000) == 0 && sfs_fwrite(fd, "end", 3) == 3, "sparse write failed");
+  check(sfs_getfilesize("sparse") == 100003, "sparse file has the wrong size");
+  check(sfs_fseekhole(fd, 0) == 0, "sparse file does not start with a hole");
+  check(sfs_fseekdata(fd, 0) == 100000 / BLOCK * BLOCK, "sfs_fseekdata did not find the data");
+  sfs_fseek(fd, 2147483000);
+  check(sfs_fwrite(fd, buffer, 1000) == -1, "write past the largest file size succeeded");
+  sfs_fclose(fd);
+  check(file_matches("sparse", 5000, zeros, 10), "hole does not read back as zeros");
+
+  /* Truncation shrinks files, and growing them again reads back zeros.
+   */
+  fd = sfs_fopen("truncated");
+  memset(buffer, 'T', 3 * BLOCK);
+  sfs_fwrite(fd, buffer, 3 * BLOCK);
+  check(sfs_ftruncate(fd, BLOCK + 10) == 0, "sfs_ftruncate failed to shrink");
+  check(sfs_getfilesize("truncated") == BLOCK + 10, "truncated file has the wrong size");
+  check(sfs_ftruncate(fd, 2 * BLOCK) == 0, "sfs_ftruncate failed to grow");
+  sfs_fclose(fd);
+  check(file_matches("truncated", BLOCK + 9, "T\0\0", 3), "bytes past a truncated end did not read back as zeros");
+
+  /* Truncating a file mapped by a two level extent tree keeps the extents
+   * before the cut, both on disk and in the block map of the descriptor, and
+   * a file cut down to nothing keeps its data in the inode again.
+   */
+  fd = sfs_fopen("deep1");
+  check(sfs_ftruncate(fd, DEEP_BLOCKS / 2 * BLOCK + 10) == 0, "sfs_ftruncate failed to shrink a two level tree");
+  fill_block(block, 5000);
+  check(sfs_pwrite(fd, block, BLOCK, (DEEP_BLOCKS / 2 + 1) * BLOCK) == BLOCK, "write after truncating failed");
+  fill_block(block, 2000 + DEEP_BLOCKS / 2);
+  memset(block + 10, 0, BLOCK - 10);
+  check(sfs_pread(fd, buffer, 2 * BLOCK, DEEP_BLOCKS / 2 * BLOCK) == 2 * BLOCK && memcmp(buffer, block, BLOCK) == 0,
+        "truncated last block read back wrong through the descriptor");
+  fill_block(block, 5000);
+  check(memcmp(buffer + BLOCK, block, BLOCK) == 0, "block written after truncating read back wrong");
+  sfs_fclose(fd);
+  check(sfs_getfilesize("deep1") == (DEEP_BLOCKS / 2 + 2) * BLOCK, "truncated two level tree has the wrong size");
+  check(blocks_match("deep1", 2000, DEEP_BLOCKS / 2), "truncating a two level tree lost the data before the cut");
+  fd = sfs_fopen("deep1");
+  check(sfs_ftruncate(fd, 0) == 0 && sfs_pwrite(fd, "short", 5, 0) == 5, "sfs_ftruncate failed to empty a file");
+  sfs_fclose(fd);
+  check(sfs_getfilesize("deep1") == 5 && file_matches("deep1", 0, "short", 5), "emptied file lost its new data");
+
+  /* Lookups through the filename index find every file created and none of
+   * those removed, including once their names are reused.
+   */
+  for (i = 0; i < INDEXED_FILES; i++) {
+    sprintf(name, "idx%d", i);
+    fd = sfs_fopen(name);
+    sfs_fwrite(fd, name, strlen(name));
+    sfs_fclose(fd);
+  }
+  for (i = 0; i < INDEXED_FILES; i += 2) {
+    sprintf(name, "idx%d", i);
+    sfs_remove(name);
+  }
+  for (i = 0; i < INDEXED_FILES; i++) {
+    sprintf(name, "idx%d", i);
+    if (sfs_getfilesize(name) != (i % 2 ? (int)strlen(name) : -1)) {
+      check(0, "filename index found a removed file or lost one");
+      break;
+    }
+  }
+  fd = sfs_fopen("idx0");
+  sfs_fwrite(fd, "again", 5);
+  sfs_fclose(fd);
+  check(file_matches("idx0", 0, "again", 5), "file created again under a removed name lost its data");
+
+  /* Directories.
+   */
+  check(sfs_mkdir("/docs") == 0, "sfs_mkdir failed");
+  check(sfs_mkdir("/docs/old") == 0, "sfs_mkdir of a subdirectory failed");
+  check(sfs_mkdir("/docs") == -1, "sfs_mkdir of an existing directory succeeded");
+  check(sfs_isdir("/docs") == 1 && sfs_isdir("frag1") == 0 && sfs_isdir("/nothing") == -1, "sfs_isdir is wrong");
+  fd = sfs_fopen("/docs/draft.txt");
+  sfs_fwrite(fd, "draft", 5);
+  sfs_fclose(fd);
+  check(file_matches("/docs/draft.txt", 0, "draft", 5), "file in a subdirectory lost its data");
+  check(sfs_getfilesize("draft.txt") == -1, "file in a subdirectory found in the root directory");
+  check(sfs_rmdir("/docs") == -1, "sfs_rmdir of a non-empty directory succeeded");
+  check(sfs_mkdir("/tmpdir") == 0 && sfs_rmdir("/tmpdir") == 0 && sfs_isdir("/tmpdir") == -1, "sfs_rmdir failed");
+
+  /* A directory holds more files than the inode table region has inodes, so
+   * the inode table grows.
+   */
+  check(sfs_mkdir("/many") == 0, "sfs_mkdir failed");
+  for (i = 0; i < MANY_FILES; i++) {
+    sprintf(name, "/many/%d", i);
+    fd = sfs_fopen(name);
+    if (fd < 0 || sfs_fwrite(fd, name, strlen(name)) != (int)strlen(name) || sfs_fclose(fd) != 0) {
+      check(0, "creating files stopped at the end of the inode table");
+      break;
+    }
+  }
+  check(file_matches("/many/0", 0, "/many/0", 7) && file_matches("/many/2099", 0, "/many/2099", 10),
+        "files in the grown inode table lost their data");
+
+  /* Names that were never created are not found, whether the negative lookup
+   * filter rules them out or not, and removed names that are created again
+   * are.
+   */
+  for (i = 0; i < INDEXED_FILES; i++) {
+    sprintf(name, "missing%d", i);
+    if (sfs_getfilesize(name) != -1) {
+      check(0, "lookup found a name that was never created");
+      break;
+    }
+  }
+  for (i = 0; i < INDEXED_FILES; i += 2) {
+    sprintf(name, "idx%d", i);
+    fd = sfs_fopen(name);
+    sfs_fclose(fd);
+    if (sfs_getfilesize(name) != (i == 0 ? 5 : 0)) {
+      check(0, "lookup missed a name created again after its removal");
+      break;
+    }
+  }
+
+  /* Names of the longest length allowed, in a directory that grows by a block
+   * at a time as their records are added.
+   */
+  check(sfs_mkdir("/long") == 0, "sfs_mkdir failed");
+  for (i = 0; i < LONG_FILES; i++) {
+    long_name(path, i);
+    fd = sfs_fopen(path);
+    if (fd < 0 || sfs_fwrite(fd, path + 6, 3) != 3 || sfs_fclose(fd) != 0) {
+      check(0, "file with the longest name allowed not created");
+      break;
+    }
+  }
+  for (i = 0; i < LONG_FILES; i++) {
+    long_name(path, i);
+    if (!file_matches(path, 0, path + 6, 3)) {
+      check(0, "file with the longest name allowed lost its data");
+      break;
+    }
+  }
+  strcat(path, "x");
+  check(sfs_fopen(path) == -1, "file with a name over the longest allowed created");
+  {
+    char listed[MAXFILENAME + 1];
+    int found = 0;
+    long_name(path, 0);
+    fd = sfs_fopen(path + 5); /* The same name in the root directory */
+    sfs_fclose(fd);
+    for (i = 0; i < 10000 && sfs_getnextfilename(listed); i++)
+      found |= strcmp(listed, path + 6) == 0;
+    check(found, "sfs_getnextfilename did not list the longest name allowed");
+  }
+  {
+    SfsDirEntry entries[4];
+    int cursor = 0;
+    res = sfs_readdirplus("/docs", &cursor, entries, 4);
+    check(res == 2, "sfs_readdirplus returned the wrong number of entries");
+    for (i = 0; i < res && i < 4; i++)
+      check(strcmp(entries[i].name, "old") == 0 ? entries[i].isDir
+            : strcmp(entries[i].name, "draft.txt") == 0 && entries[i].size == 5 && !entries[i].isDir,
+            "sfs_readdirplus returned the wrong entries");
+    check(sfs_readdirplus("/docs", &cursor, entries, 4) == 0, "sfs_readdirplus did not end");
+  }
+
+  /* Renames only move directory entries, and update the lookup indexes.
+   */
+  check(sfs_rename("/docs/draft.txt", "/docs/old/final.txt") == 0, "sfs_rename across directories failed");
+  check(sfs_getfilesize("/docs/draft.txt") == -1, "sfs_rename left the old name behind");
+  check(file_matches("/docs/old/final.txt", 0, "draft", 5), "renamed file lost its data");
+  check(sfs_rename("/docs", "/docs/old/docs") == -1, "directory moved inside itself");
+  check(sfs_rmdir("/docs/old") == -1, "sfs_rmdir of a non-empty directory succeeded");
+  check(sfs_rename("idx1", "renamed1") == 0 && sfs_getfilesize("idx1") == -1 && sfs_getfilesize("renamed1") == 4,
+        "renamed file not found under its new name only");
+  check(sfs_rename("idx3", "idx5") == 0 && sfs_getfilesize("idx3") == -1 && file_matches("idx5", 0, "idx3", 4),
+        "rename did not replace the existing file");
+
+  /* A file removed, or replaced by a rename, while it is open is still read
+   * and written through its descriptors until they are closed.
+   */
+  fd = sfs_fopen("removed");
+  sfs_fwrite(fd, "removed", 7);
+  check(sfs_remove("removed") == 0 && sfs_getfilesize("removed") == -1, "open file not removed");
+  check(sfs_fwrite(fd, "!", 1) == 1, "write to a removed open file failed");
+  fd2 = sfs_fopen("removed");
+  sfs_fwrite(fd2, "new", 3);
+  sfs_fclose(fd2);
+  check(sfs_fseek(fd, 0) == 0 && sfs_fread(fd, buffer, 8) == 8 && memcmp(buffer, "removed!", 8) == 0,
+        "removed open file lost its data");
+  sfs_fclose(fd);
+  fd = sfs_fopen("replaced");
+  sfs_fwrite(fd, "old", 3);
+  check(sfs_rename("removed", "replaced") == 0, "sfs_rename over an open file failed");
+  check(sfs_fseek(fd, 0) == 0 && sfs_fread(fd, buffer, 3) == 3 && memcmp(buffer, "old", 3) == 0,
+        "replaced open file lost its data");
+  sfs_fclose(fd);
+  check(file_matches("replaced", 0, "new", 3) && sfs_getfilesize("removed") == -1,
+        "rename over an open file left the wrong names");
+
+  /* The descriptor table grows past its initial size, and the entry of a
+   * closed descriptor is used again.
+   */
+  {
+    int fds[OPEN_FILES];
+    for (i = 0; i < OPEN_FILES; i++) {
+      sprintf(name, "open%d", i);
+      fds[i] = sfs_fopen(name);
+      check(fds[i] >= 0, "descriptor table did not grow");
+    }
+    sfs_fclose(fds[OPEN_FILES / 2]);
+    fd = sfs_fopen("reopened");
+    check(fd == fds[OPEN_FILES / 2], "closed descriptor not used again");
+    sfs_fwrite(fd, "reopened", 8);
+    sfs_fclose(fd);
+    for (i = 0; i < OPEN_FILES; i++) {
+      if (i != OPEN_FILES / 2) {
+        check(sfs_fwrite(fds[i], "open", 4) == 4, "write through a descriptor of the grown table failed");
+        sfs_fclose(fds[i]);
+      }
+    }
+    check(file_matches("open39", 0, "open", 4) && file_matches("reopened", 0, "reopened", 8),
+          "file written through the grown descriptor table lost its data");
+  }
+
+  /* Positional reads and writes leave the read/write head alone.
+   */
+  fd = sfs_fopen("positional");
+  sfs_fwrite(fd, "0123456789", 10);
+  check(sfs_pwrite(fd, "ab", 2, 3) == 2, "sfs_pwrite failed");
+  check(sfs_pread(fd, buffer, 4, 2) == 4 && memcmp(buffer, "2ab5", 4) == 0, "sfs_pread read the wrong data");
+  sfs_fwrite(fd, "X", 1);
+  sfs_fclose(fd);
+  check(file_matches("positional", 0, "012ab56789X", 11), "positional I/O moved the read/write head");
+
+  /* Descriptors of the same file share its size and block map, so each one
+   * reads what the other appended.
+   */
+  fd = sfs_fopen("shared");
+  fill_block(block, 5000);
+  sfs_fwrite(fd, block, BLOCK);
+  sfs_fseek(fd, 0);
+  sfs_fread(fd, buffer, BLOCK);
+  fd2 = sfs_fopen("shared");
+  check(fd2 >= 0 && fd2 != fd, "opening an open file did not return a new descriptor");
+  fill_block(block, 5001);
+  sfs_fwrite(fd2, block, BLOCK);
+  check(sfs_fread(fd, buffer, BLOCK) == BLOCK && memcmp(buffer, block, BLOCK) == 0,
+        "descriptor did not read a block appended through another");
+  sfs_fclose(fd);
+  check(sfs_fwrite(fd2, "!", 1) == 1 && sfs_getfilesize("shared") == 2 * BLOCK + 1,
+        "closing a descriptor affected another of the same file");
+  sfs_fclose(fd2);
+
+  /* Reads of whole blocks, straight into the caller's buffer, and of parts of
+   * blocks return the same data.
+   */
+  fd = sfs_fopen("large");
+  sfs_fseek(fd, BLOCK);
+  check(sfs_fread(fd, buffer, 3 * BLOCK) == 3 * BLOCK, "read of whole blocks failed");
+  for (i = 0; i < 3; i++) {
+    fill_block(block, 1001 + i);
+    check(memcmp(buffer + i * BLOCK, block, BLOCK) == 0, "read of whole blocks returned the wrong data");
+  }
+  sfs_fseek(fd, 500);
+  check(sfs_fread(fd, buffer, 2 * BLOCK + 100) == 2 * BLOCK + 100, "read of parts of blocks failed");
+  fill_block(block, 1000);
+  check(memcmp(buffer, block + 500, BLOCK - 500) == 0, "read of parts of blocks returned the wrong data");
+  fill_block(block, 1002);
+  check(memcmp(buffer + 2 * BLOCK - 500, block, 600) == 0, "read of parts of blocks returned the wrong data");
+  sfs_fclose(fd);
+
+  /* Small sequential reads are served from the blocks read ahead, and see
+   * writes made through another descriptor meanwhile.
+   */
+  fd = sfs_fopen("ahead");
+  for (i = 0; i < AHEAD_BLOCKS; i++) {
+    fill_block(block, 6000 + i);
+    sfs_fwrite(fd, block, BLOCK);
+  }
+  sfs_fseek(fd, 0);
+  for (i = 0; i < AHEAD_BLOCKS; i++) {
+    int part;
+    fill_block(block, 6000 + i);
+    if (i == AHEAD_BLOCKS / 2) {
+      fd2 = sfs_fopen("ahead");
+      sfs_pwrite(fd2, "NEW!", 4, (i + 2) * BLOCK);
+      sfs_fclose(fd2);
+    }
+    if (i == AHEAD_BLOCKS / 2 + 2)
+      memcpy(block, "NEW!", 4);
+    for (part = 0; part < 4; part++) {
+      if (sfs_fread(fd, buffer + part * (BLOCK / 4), BLOCK / 4) != BLOCK / 4)
+        break;
+    }
+    if (part < 4 || memcmp(buffer, block, BLOCK) != 0) {
+      check(0, "sequential reads returned the wrong data");
+      break;
+    }
+  }
+  sfs_fclose(fd);
+
+  /* Buffered appends count in the file size right away, and reach the disk
+   * when the descriptor is flushed or closed.
+   */
+  fd = sfs_fopen("buffered");
+  sfs_fwrite(fd, "HELLO", 5);
+  fd2 = sfs_fopen("buffered");
+  sfs_fwrite(fd2, "WORLD", 5);
+  check(sfs_getfilesize("buffered") == 10, "buffered appends not counted in the file size");
+  sfs_fclose(fd);
+  sfs_fclose(fd2);
+  check(file_matches("buffered", 0, "HELLOWORLD", 10), "appends through two descriptors lost data");
+
+  fd = sfs_fopen("buffered");
+  check(sfs_fsetbuffering(fd, 0) == 0, "sfs_fsetbuffering failed");
+  sfs_fwrite(fd, "!", 1);
+  check(sfs_fflush(fd) == 0, "sfs_fflush failed");
+  sfs_fclose(fd);
+  check(file_matches("buffered", 0, "HELLOWORLD!", 11), "unbuffered append lost");
+
+  /* Vectored I/O, with a buffer boundary in the middle of a block.
+   */
+  {
+    char head[BLOCK + 100], tail[2 * BLOCK], out1[700], out2[BLOCK + 400], out3[900];
+    SfsIovec in[2], out[3];
+    for (i = 0; i < (int)sizeof(head); i++)
+      head[i] = (char)i;
+    for (i = 0; i < (int)sizeof(tail); i++)
+      tail[i] = (char)(i * 7);
+    in[0].base = head; in[0].length = sizeof(head);
+    in[1].base = tail; in[1].length = sizeof(tail);
+    out[0].base = out1; out[0].length = sizeof(out1);
+    out[1].base = out2; out[1].length = sizeof(out2);
+    out[2].base = out3; out[2].length = sizeof(out3);
+
+    fd = sfs_fopen("vectored");
+    check(sfs_writev(fd, in, 2) == (int)(sizeof(head) + sizeof(tail)), "sfs_writev failed");
+    check(sfs_pwritev(fd, in, 1, 50) == (int)sizeof(head), "sfs_pwritev failed");
+    sfs_fseek(fd, 0);
+    check(sfs_readv(fd, out, 3) == (int)(sizeof(out1) + sizeof(out2) + sizeof(out3)), "sfs_readv failed");
+    check(memcmp(out1, "\0\1\2", 3) == 0 && memcmp(out1 + 50, head, 650) == 0, "sfs_readv read the wrong data");
+    check(memcmp(out2 + sizeof(head) + 50 - 700, tail + 50, 100) == 0, "sfs_pwritev wrote the wrong data");
+    check(sfs_preadv(fd, out + 2, 1, sizeof(head) + 50) == (int)sizeof(out3)
+          && memcmp(out3, tail + 50, sizeof(out3)) == 0, "sfs_preadv read the wrong data");
+    sfs_fclose(fd);
+  }
+
+  /* Memory mapping: shared mappings are written back by sfs_msync() and
+   * sfs_munmap(), private ones never are.
+   */
+  fd = sfs_fopen("mapped");
+  memset(buffer, 'm', 2 * BLOCK);
+  sfs_fwrite(fd, buffer, 2 * BLOCK);
+  {
+    char *shared = sfs_mmap(fd, BLOCK - 4, 8, SFS_MAP_SHARED);
+    char *private = sfs_mmap(fd, 0, 4, SFS_MAP_PRIVATE);
+    check(shared != NULL && private != NULL && shared[0] == 'm' && private[3] == 'm', "sfs_mmap failed");
+    if (shared != NULL && private != NULL) {
+      memcpy(shared, "SYNCED!!", 8);
+      check(sfs_msync(shared, 4) == 0, "sfs_msync failed");
+      check(file_matches("mapped", BLOCK - 4, "SYNCmmmm", 8), "sfs_msync did not write back just its range");
+      memcpy(private, "PRIV", 4);
+      check(sfs_munmap(shared) == 0 && sfs_munmap(private) == 0, "sfs_munmap failed");
+      check(file_matches("mapped", 0, "mmmm", 4), "private mapping was written back");
+    }
+  }
+  sfs_fclose(fd);
+  check(file_matches("mapped", BLOCK - 4, "SYNCED!!", 8), "sfs_munmap did not write back the mapping");
+
+  /* Everything is still there after remounting.
+   */
+  mksfs(0);
+  check(blocks_match("frag2", 100, FRAG_BLOCKS), "defragmented file lost on remount");
+  check(blocks_match("large", 1000, LARGE_BLOCKS), "large file lost on remount");
+  check(blocks_match("deep2", 3000, DEEP_BLOCKS), "file mapped by a two level extent tree lost on remount");
+  fill_block(block, 4000 + DEEP_BLOCKS + 1);
+  check(file_matches("holes", (DEEP_BLOCKS + 1) * BLOCK, block, BLOCK), "filled hole lost on remount");
+  check(file_matches("tiny", 0, "tiny filet", 10), "file moved out of the inode lost on remount");
+  check(file_matches("tiny2", 0, "inline", 6), "inline data moved to its own block lost on remount");
+  check(file_matches("sparse", 99999, "\0end", 4), "sparse file lost on remount");
+  check(sfs_getfilesize("truncated") == 2 * BLOCK, "truncated size lost on remount");
+  check(file_matches("deep1", 0, "short", 5), "emptied file lost on remount");
+  check(sfs_getfilesize("idx0") == 5 && sfs_getfilesize("idx7") == 4, "filename index wrong after remount");
+  check(sfs_isdir("/docs/old") == 1, "directory lost on remount");
+  check(file_matches("/many/2099", 0, "/many/2099", 10), "file in the grown inode table lost on remount");
+  long_name(path, LONG_FILES - 1);
+  check(file_matches(path, 0, path + 6, 3), "file with the longest name allowed lost on remount");
+  check(file_matches("/docs/old/final.txt", 0, "draft", 5), "renamed file lost on remount");
+  check(file_matches("positional", 0, "012ab56789X", 11), "positional writes lost on remount");
+  check(file_matches("buffered", 0, "HELLOWORLD!", 11), "buffered appends lost on remount");
+  check(file_matches("mapped", BLOCK - 4, "SYNCED!!", 8), "mapping write-back lost on remount");
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}